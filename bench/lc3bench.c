@@ -0,0 +1,204 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs lc3asm over each input and reports source lines, wall time, throughput
+// and peak resident set size. Each input is assembled `repeats` times and the
+// fastest run is reported, with output discarded. With -T, the last run also
+// passes -T to lc3asm so its per-phase table is printed alongside.
+
+enum {
+	FAILURE_ARGS = 1,
+	FAILURE_IO = 2,
+	FAILURE_INTERNAL = 5,
+};
+
+typedef struct Options {
+	const char *assembler;
+	unsigned repeats;
+	bool stats;
+	int first_file;
+} Options;
+
+typedef struct RunResult {
+	double seconds;
+	long peak_rss_kib;
+} RunResult;
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-a<lc3asm path>] [-r<repeats>] [-T] file.asm...\n", name);
+}
+
+static void parse_options(int argc, char *argv[], Options *options) {
+	*options = (Options){ "out/lc3asm", 3, false, argc };
+	int i;
+	for (i = 1; i < argc; ++i) {
+		char *arg = argv[i];
+		if (arg[0] != '-') {
+			break;
+		}
+		switch (arg[1]) {
+			case 'a':
+				if (!arg[2]) {
+					goto bad_argument;
+				}
+				options->assembler = &arg[2];
+				break;
+			case 'r': {
+				char *end;
+				unsigned long repeats = strtoul(&arg[2], &end, 10);
+				if (end == &arg[2] || *end || repeats < 1) {
+					goto bad_argument;
+				}
+				options->repeats = (unsigned)repeats;
+				break;
+			}
+			case 'T':
+				if (arg[2]) {
+					goto bad_argument;
+				}
+				options->stats = true;
+				break;
+			default:
+				goto bad_argument;
+		}
+		continue;
+
+	bad_argument:
+		fprintf(stderr, "bad argument '%s'\n", arg);
+		usage(argv[0]);
+		exit(FAILURE_ARGS);
+	}
+	if (i == argc) {
+		usage(argv[0]);
+		exit(FAILURE_ARGS);
+	}
+	options->first_file = i;
+}
+
+static size_t count_lines(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "could not open file \"%s\"\n", path);
+		exit(FAILURE_IO);
+	}
+	size_t lines = 0;
+	int last = '\n';
+	int c;
+	while ((c = fgetc(file)) != EOF) {
+		if (c == '\n') {
+			lines += 1;
+		}
+		last = c;
+	}
+	if (last != '\n') {
+		lines += 1;
+	}
+	fclose(file);
+	return lines;
+}
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool run_once(const char *assembler, const char *path, bool stats, RunResult *result) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(FAILURE_INTERNAL);
+	}
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+			_exit(127);
+		}
+		if (stats) {
+			execl(assembler, assembler, "-T", path, (char*)NULL);
+		}
+		else {
+			execl(assembler, assembler, path, (char*)NULL);
+		}
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	while (wait4(pid, &status, 0, &usage) < 0) {
+		if (errno != EINTR) {
+			perror("wait4");
+			exit(FAILURE_INTERNAL);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (WIFEXITED(status)) {
+			fprintf(stderr, "%s %s: exited with status %i\n", assembler, path, WEXITSTATUS(status));
+		}
+		else {
+			fprintf(stderr, "%s %s: terminated abnormally\n", assembler, path);
+		}
+		return false;
+	}
+	result->seconds = elapsed_seconds(&start, &end);
+	result->peak_rss_kib = usage.ru_maxrss;
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	parse_options(argc, argv, &options);
+
+	bool failed = false;
+	printf("%-32s %10s %10s %12s %10s\n", "file", "lines", "time(ms)", "lines/s", "rss(KiB)");
+	for (int i = options.first_file; i < argc; ++i) {
+		const char *path = argv[i];
+		size_t lines = count_lines(path);
+
+		RunResult best = { 0 };
+		bool ok = true;
+		for (unsigned r = 0; r < options.repeats && ok; ++r) {
+			RunResult run;
+			bool last = r + 1 == options.repeats;
+			if (last && options.stats) {
+				fprintf(stderr, "%s:\n", path);
+			}
+			ok = run_once(options.assembler, path, last && options.stats, &run);
+			if (ok && (r == 0 || run.seconds < best.seconds)) {
+				best.seconds = run.seconds;
+			}
+			if (ok && run.peak_rss_kib > best.peak_rss_kib) {
+				best.peak_rss_kib = run.peak_rss_kib;
+			}
+		}
+		if (!ok) {
+			failed = true;
+			printf("%-32s %10zu %10s %12s %10s\n", path, lines, "failed", "-", "-");
+			continue;
+		}
+		printf(
+			"%-32s %10zu %10.2f %12.0f %10ld\n",
+			path,
+			lines,
+			best.seconds * 1e3,
+			best.seconds > 0 ? lines / best.seconds : 0.0,
+			best.peak_rss_kib);
+		fflush(stdout);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
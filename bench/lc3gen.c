@@ -0,0 +1,403 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates synthetic LC-3 sources for benchmarking lc3asm. Output is always
+// valid for lc3asm: every label reference stays within the 9-bit PC-relative
+// range, and code stops once the address space is exhausted (remaining lines
+// become comments).
+
+enum {
+	FAILURE_ARGS = 1,
+	FAILURE_MEMORY = 7,
+};
+
+enum {
+	ORIGIN = 0x3000,
+	MAX_STRING_CHARS = 48,
+	OFFSET9_MIN = -256,
+	OFFSET9_MAX = 255,
+};
+
+typedef enum LineKind {
+	LK_Blank = 1,
+	LK_Comment,
+	LK_Arithmetic,
+	LK_DestOffset,
+	LK_Branch,
+	LK_BaseR,
+	LK_WordLiteral,
+	LK_String,
+} LineKind;
+
+typedef struct LinePlan {
+	uint8_t kind;
+	uint8_t string_chars;
+	bool has_label;
+	bool trailing_comment;
+} LinePlan;
+
+typedef struct Options {
+	size_t lines;
+	unsigned label_density;
+	unsigned forward_ratio;
+	unsigned string_density;
+	unsigned comment_density;
+	uint64_t seed;
+} Options;
+
+static const char *ArithmeticOps[] = { "ADD", "AND" };
+static const char *DestOffsetOps[] = { "LD", "LDI", "LEA", "ST", "STI" };
+static const char *BranchOps[] = { "BR", "BRn", "BRz", "BRp", "BRnz", "BRnp", "BRzp", "BRnzp" };
+static const char *BaseROps[] = { "JMP", "JSRR" };
+static const char *WordLiteralOps[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "RET" };
+static const char *CommentWords[] = {
+	"load", "store", "the", "counter", "pointer", "loop", "until", "done", "next", "value",
+	"save", "restore", "check", "flag", "buffer", "index", "result", "return", "call", "table",
+};
+
+#define COUNTOF(array) (sizeof(array) / sizeof((array)[0]))
+
+static uint64_t g_rng_state;
+
+static uint64_t rng_next(void) {
+	// xorshift64*; deterministic across platforms unlike rand()
+	uint64_t x = g_rng_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	g_rng_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+static unsigned rng_below(unsigned bound) {
+	return (unsigned)(rng_next() % bound);
+}
+static bool rng_percent(unsigned percent) {
+	return rng_below(100) < percent;
+}
+
+static void usage(const char *name) {
+	fprintf(
+		stderr,
+		"usage: %s [-n<lines>] [-l<label%%>] [-f<forward%%>] [-s<string%%>] [-c<comment%%>] [-r<seed>]\n"
+		"  -n  number of source lines to produce (default 10000)\n"
+		"  -l  percentage of code lines carrying a label (default 10)\n"
+		"  -f  percentage of label references that point forward (default 30)\n"
+		"  -s  percentage of code lines that are .stringz literals (default 5)\n"
+		"  -c  percentage of comment lines, and of code lines with a trailing comment (default 20)\n"
+		"  -r  random seed (default 1)\n",
+		name);
+}
+
+static bool parse_percent(const char *value, unsigned *result) {
+	char *end;
+	unsigned long number = strtoul(value, &end, 10);
+	if (end == value || *end || number > 100) {
+		return false;
+	}
+	*result = (unsigned)number;
+	return true;
+}
+
+static void parse_options(int argc, char *argv[], Options *options) {
+	*options = (Options){ 10000, 10, 30, 5, 20, 1 };
+	for (int i = 1; i < argc; ++i) {
+		char *arg = argv[i];
+		char *value = &arg[2];
+		bool ok = arg[0] == '-' && arg[1] && *value;
+		if (ok) {
+			char *end;
+			switch (arg[1]) {
+				case 'n':
+					options->lines = strtoul(value, &end, 10);
+					ok = end != value && !*end;
+					break;
+				case 'r':
+					options->seed = strtoull(value, &end, 10);
+					ok = end != value && !*end;
+					break;
+				case 'l':
+					ok = parse_percent(value, &options->label_density);
+					break;
+				case 'f':
+					ok = parse_percent(value, &options->forward_ratio);
+					break;
+				case 's':
+					ok = parse_percent(value, &options->string_density);
+					break;
+				case 'c':
+					ok = parse_percent(value, &options->comment_density);
+					break;
+				default:
+					ok = false;
+					break;
+			}
+		}
+		if (!ok) {
+			fprintf(stderr, "bad argument '%s'\n", arg);
+			usage(argv[0]);
+			exit(FAILURE_ARGS);
+		}
+	}
+	if (options->seed == 0) {
+		// xorshift state must be non-zero
+		options->seed = 1;
+	}
+}
+
+static size_t line_words(const LinePlan *plan) {
+	switch (plan->kind) {
+		case LK_Blank:
+		case LK_Comment:
+			return 0;
+		case LK_String:
+			return plan->string_chars + 1u;
+		default:
+			return 1;
+	}
+}
+
+static LineKind pick_code_kind(const Options *options) {
+	if (rng_percent(options->string_density)) {
+		return LK_String;
+	}
+	unsigned roll = rng_below(100);
+	if (roll < 35) {
+		return LK_Arithmetic;
+	}
+	else if (roll < 65) {
+		return LK_DestOffset;
+	}
+	else if (roll < 85) {
+		return LK_Branch;
+	}
+	else if (roll < 92) {
+		return LK_BaseR;
+	}
+	else {
+		return LK_WordLiteral;
+	}
+}
+
+// Lays out every line up front so that label addresses are known before any
+// text is produced; forward references can then be chosen in range.
+static LinePlan *plan_lines(const Options *options, uint16_t **label_addresses, size_t *label_count) {
+	LinePlan *plans = calloc(options->lines ? options->lines : 1, sizeof(LinePlan));
+	uint16_t *labels = malloc((options->lines ? options->lines : 1) * sizeof(uint16_t));
+	if (!plans || !labels) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+
+	size_t address = ORIGIN;
+	size_t nLabels = 0;
+	bool exhausted = false;
+	// line 0 is the .org directive
+	for (size_t i = 1; i < options->lines; ++i) {
+		LinePlan *plan = &plans[i];
+		if (exhausted || rng_percent(options->comment_density)) {
+			plan->kind = rng_below(4) == 0 ? LK_Blank : LK_Comment;
+			continue;
+		}
+		plan->kind = pick_code_kind(options);
+		if (plan->kind == LK_String) {
+			plan->string_chars = 1 + rng_below(MAX_STRING_CHARS);
+		}
+		size_t words = line_words(plan);
+		if (address + words > 0x10000) {
+			exhausted = true;
+			plan->kind = LK_Comment;
+			plan->string_chars = 0;
+			continue;
+		}
+		plan->has_label = rng_percent(options->label_density);
+		plan->trailing_comment = rng_percent(options->comment_density);
+		if (plan->has_label) {
+			labels[nLabels++] = (uint16_t)address;
+		}
+		address += words;
+	}
+	if (exhausted) {
+		fprintf(stderr, "note: address space exhausted at x%04zX; remaining code lines emitted as comments\n", address);
+	}
+
+	*label_addresses = labels;
+	*label_count = nLabels;
+	return plans;
+}
+
+// index of first label whose address is >= address
+static size_t lower_bound(const uint16_t *labels, size_t count, long address) {
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (labels[mid] < address) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Picks a label reachable from `address` with a 9-bit PC-relative offset;
+// returns false when no label is in range.
+static bool pick_target(const Options *options, const uint16_t *labels, size_t count, long address, size_t *target) {
+	long pc = address + 1;
+	size_t back_first = lower_bound(labels, count, pc + OFFSET9_MIN);
+	size_t split = lower_bound(labels, count, pc);
+	size_t fwd_end = lower_bound(labels, count, pc + OFFSET9_MAX + 1);
+	size_t nBack = split - back_first;
+	size_t nForward = fwd_end - split;
+
+	bool forward = rng_percent(options->forward_ratio);
+	if (forward && nForward == 0) {
+		forward = false;
+	}
+	else if (!forward && nBack == 0) {
+		forward = true;
+	}
+	if (forward && nForward > 0) {
+		*target = split + rng_below((unsigned)nForward);
+		return true;
+	}
+	else if (!forward && nBack > 0) {
+		*target = back_first + rng_below((unsigned)nBack);
+		return true;
+	}
+	return false;
+}
+
+static void print_comment(FILE *output) {
+	fputs("; ", output);
+	unsigned words = 2 + rng_below(8);
+	for (unsigned i = 0; i < words; ++i) {
+		fprintf(output, i ? " %s" : "%s", CommentWords[rng_below(COUNTOF(CommentWords))]);
+	}
+}
+
+static void print_label_ref(
+	FILE *output,
+	const Options *options,
+	const uint16_t *labels,
+	size_t count,
+	size_t address
+) {
+	size_t target;
+	if (pick_target(options, labels, count, (long)address, &target)) {
+		fprintf(output, "L%zu", target);
+	}
+	else {
+		fprintf(output, "#%i", (int)rng_below(64) - 32);
+	}
+}
+
+static void print_line(
+	FILE *output,
+	const Options *options,
+	const LinePlan *plan,
+	const uint16_t *labels,
+	size_t count,
+	size_t *next_label,
+	size_t address
+) {
+	switch (plan->kind) {
+		case LK_Blank:
+			fputc('\n', output);
+			return;
+		case LK_Comment:
+			print_comment(output);
+			fputc('\n', output);
+			return;
+		default:
+			break;
+	}
+
+	if (plan->has_label) {
+		fprintf(output, "L%zu", (*next_label)++);
+	}
+	fputc('\t', output);
+	switch (plan->kind) {
+		case LK_Arithmetic: {
+			const char *op = ArithmeticOps[rng_below(COUNTOF(ArithmeticOps))];
+			unsigned dest = rng_below(8);
+			unsigned lhs = rng_below(8);
+			if (rng_below(2)) {
+				fprintf(output, "%s R%u, R%u, R%u", op, dest, lhs, rng_below(8));
+			}
+			else {
+				fprintf(output, "%s R%u, R%u, #%i", op, dest, lhs, (int)rng_below(32) - 16);
+			}
+			break;
+		}
+		case LK_DestOffset:
+			fprintf(output, "%s R%u, ", DestOffsetOps[rng_below(COUNTOF(DestOffsetOps))], rng_below(8));
+			print_label_ref(output, options, labels, count, address);
+			break;
+		case LK_Branch:
+			fprintf(output, "%s ", BranchOps[rng_below(COUNTOF(BranchOps))]);
+			print_label_ref(output, options, labels, count, address);
+			break;
+		case LK_BaseR:
+			fprintf(output, "%s R%u", BaseROps[rng_below(COUNTOF(BaseROps))], rng_below(8));
+			break;
+		case LK_WordLiteral:
+			fputs(WordLiteralOps[rng_below(COUNTOF(WordLiteralOps))], output);
+			break;
+		case LK_String: {
+			fputs(".STRINGZ \"", output);
+			size_t chars = plan->string_chars;
+			bool newline = chars > 1 && rng_below(4) == 0;
+			if (newline) {
+				chars -= 1;
+			}
+			for (size_t i = 0; i < chars; ++i) {
+				unsigned roll = rng_below(27);
+				fputc(roll == 26 ? ' ' : 'a' + (int)roll, output);
+			}
+			fputs(newline ? "\\n\"" : "\"", output);
+			break;
+		}
+		default:
+			fprintf(stderr, "unrecognized line kind (%u)\n", plan->kind);
+			exit(FAILURE_ARGS);
+	}
+	if (plan->trailing_comment) {
+		fputc(' ', output);
+		print_comment(output);
+	}
+	fputc('\n', output);
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	parse_options(argc, argv, &options);
+	g_rng_state = options.seed;
+
+	uint16_t *labels;
+	size_t nLabels;
+	LinePlan *plans = plan_lines(&options, &labels, &nLabels);
+
+	FILE *output = stdout;
+	if (options.lines > 0) {
+		fprintf(output, ".ORG x%04X\n", ORIGIN);
+	}
+	size_t address = ORIGIN;
+	size_t next_label = 0;
+	for (size_t i = 1; i < options.lines; ++i) {
+		print_line(output, &options, &plans[i], labels, nLabels, &next_label, address);
+		address += line_words(&plans[i]);
+	}
+
+	free(plans);
+	free(labels);
+	if (fflush(output) != 0 || ferror(output)) {
+		fputs("error while writing output\n", stderr);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,217 @@
+#include "lc3asm.h"
+
+enum {
+	OPCODE_COUNT = 16,
+	FORMAT_COUNT = IF_BaseR + 1,
+};
+
+typedef struct BlockLabel {
+	const char *name;
+	size_t length;
+	uint16_t target;
+	size_t order;
+} BlockLabel;
+
+typedef struct LabelList {
+	BlockLabel *labels;
+	size_t count;
+} LabelList;
+
+typedef struct Tally {
+	size_t words;
+	size_t instructions;
+	size_t cycles;
+	size_t opcodes[OPCODE_COUNT];
+	size_t formats[FORMAT_COUNT];
+	size_t back_edges;
+} Tally;
+
+static const char *OpcodeNames[OPCODE_COUNT] = {
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "reserved", "LEA", "TRAP",
+};
+// 0 stands for instructions without one, like NOT and the traps
+static const InstructionFormat OpcodeFormats[OPCODE_COUNT] = {
+	IF_Offset9, IF_Arithmetic, IF_DestOffset, IF_DestOffset, IF_BaseR, IF_Arithmetic, 0, 0,
+	0, 0, IF_DestOffset, IF_DestOffset, IF_BaseR, 0, IF_DestOffset, 0,
+};
+static const char *FormatNames[FORMAT_COUNT] = {
+	[0] = "none",
+	[IF_Arithmetic] = "arithmetic",
+	[IF_DestOffset] = "dest_offset",
+	[IF_Offset9] = "offset9",
+	[IF_BaseR] = "base_r",
+};
+// States of the LC-3 control unit from fetch to completion, with memory that
+// answers in one cycle; branches are counted as not taken.
+static const uint8_t OpcodeCycles[OPCODE_COUNT] = {
+	5, 5, 7, 7, 6, 5, 7, 7,
+	13, 5, 9, 9, 5, 5, 5, 7,
+};
+
+static void collect_label(void *context, const char *name, size_t length, uint16_t target) {
+	LabelList *list = context;
+	list->labels[list->count] = (BlockLabel){ name, length, target, list->count };
+	list->count += 1;
+}
+static int compare_labels(const void *lhs, const void *rhs) {
+	const BlockLabel *a = lhs;
+	const BlockLabel *b = rhs;
+	if (a->target != b->target) {
+		return a->target < b->target ? -1 : 1;
+	}
+	return a->order < b->order ? -1 : a->order > b->order;
+}
+
+// A branch that can be taken and does not go forwards; an unresolved offset
+// is still 0 and points nowhere yet.
+static bool is_back_edge(const CompilationUnit *CU, size_t i) {
+	uint16_t word = CU->buffer[i];
+	return (CU->kinds[i] & (WK_Code | WK_Linked)) == WK_Code && word >> 12 == 0 && word & 0x0E00 && word & 0x0100;
+}
+
+static void tally_words(const CompilationUnit *CU, size_t start, size_t end, Tally *tally) {
+	for (size_t i = start; i < end; ++i) {
+		tally->words += 1;
+		if (!(CU->kinds[i] & WK_Code)) {
+			continue;
+		}
+		uint16_t word = CU->buffer[i];
+		unsigned opcode = word >> 12;
+		tally->instructions += 1;
+		tally->cycles += OpcodeCycles[opcode];
+		tally->opcodes[opcode] += 1;
+		tally->formats[OpcodeFormats[opcode]] += 1;
+		if (is_back_edge(CU, i)) {
+			tally->back_edges += 1;
+		}
+	}
+}
+static void add_tally(Tally *total, const Tally *tally) {
+	total->words += tally->words;
+	total->instructions += tally->instructions;
+	total->cycles += tally->cycles;
+	for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+		total->opcodes[i] += tally->opcodes[i];
+	}
+	for (size_t i = 0; i < FORMAT_COUNT; ++i) {
+		total->formats[i] += tally->formats[i];
+	}
+	total->back_edges += tally->back_edges;
+}
+
+static void write_string(FILE *output, const char *string) {
+	fputc('"', output);
+	for (; *string; ++string) {
+		unsigned char c = *string;
+		if (c == '"' || c == '\\') {
+			fprintf(output, "\\%c", c);
+		}
+		else if (c < 0x20) {
+			fprintf(output, "\\u%04x", c);
+		}
+		else {
+			fputc(c, output);
+		}
+	}
+	fputc('"', output);
+}
+
+static void write_tally(FILE *output, const Tally *tally) {
+	fprintf(
+		output,
+		"\"words\":%zu,\"instructions\":%zu,\"cycles\":%zu,\"back_edges\":%zu,\"memory\":{\"LD\":%zu,\"LDI\":%zu,\"ST\":%zu,\"STI\":%zu}",
+		tally->words,
+		tally->instructions,
+		tally->cycles,
+		tally->back_edges,
+		tally->opcodes[0x2],
+		tally->opcodes[0xA],
+		tally->opcodes[0x3],
+		tally->opcodes[0xB]);
+	fputs(",\"opcodes\":{", output);
+	const char *separator = "";
+	for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+		if (tally->opcodes[i]) {
+			fprintf(output, "%s\"%s\":%zu", separator, OpcodeNames[i], tally->opcodes[i]);
+			separator = ",";
+		}
+	}
+	fputs("},\"formats\":{", output);
+	separator = "";
+	for (size_t i = 0; i < FORMAT_COUNT; ++i) {
+		if (tally->formats[i]) {
+			fprintf(output, "%s\"%s\":%zu", separator, FormatNames[i], tally->formats[i]);
+			separator = ",";
+		}
+	}
+	fputc('}', output);
+}
+static void write_edges(FILE *output, const CompilationUnit *CU, size_t start, size_t end) {
+	fputs(",\"loops\":[", output);
+	const char *separator = "";
+	for (size_t i = start; i < end; ++i) {
+		if (is_back_edge(CU, i)) {
+			long offset = (long)(CU->buffer[i] & 0x01FF) - 0x200;
+			fprintf(
+				output,
+				"%s{\"from\":\"x%04zX\",\"to\":\"x%04lX\"}",
+				separator,
+				CU->origin + i,
+				(long)CU->origin + (long)i + 1 + offset);
+			separator = ",";
+		}
+	}
+	fputc(']', output);
+}
+
+void analysis_write(CompilationUnit *CU, const char *name, FILE *output) {
+	LOGF_INFO("analysis");
+	if (!CU->kinds) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "analysis_write: word kinds were not tracked");
+	}
+	LabelList list = { NULL, 0 };
+	if (CU->label_count > 0) {
+		list.labels = diag_alloc(CU->diagnostics, CU->label_count * sizeof(BlockLabel));
+		cu_each_label(CU, collect_label, &list);
+		qsort(list.labels, list.count, sizeof(BlockLabel), compare_labels);
+	}
+
+	size_t size = CU->buffer_offset;
+	Tally total = { 0 };
+	fputs("{\"name\":", output);
+	write_string(output, name);
+	fprintf(output, ",\"origin\":\"x%04X\",\"blocks\":[", CU->origin);
+	size_t next = 0;
+	size_t start = 0;
+	bool first_block = true;
+	// labels past the last word still get a block, an empty one
+	do {
+		// every label at this address names the block
+		size_t first = next;
+		while (next < list.count && (size_t)(list.labels[next].target - CU->origin) <= start) {
+			next += 1;
+		}
+		size_t end = next < list.count ? (size_t)(list.labels[next].target - CU->origin) : size;
+		if (end > size) {
+			end = size;
+		}
+		fprintf(output, "%s{\"address\":\"x%04zX\",\"labels\":[", first_block ? "" : ",", CU->origin + start);
+		first_block = false;
+		for (size_t i = first; i < next; ++i) {
+			fprintf(output, "%s\"%.*s\"", i == first ? "" : ",", (int)list.labels[i].length, list.labels[i].name);
+		}
+		fputs("],", output);
+		Tally tally = { 0 };
+		tally_words(CU, start, end, &tally);
+		write_tally(output, &tally);
+		write_edges(output, CU, start, end);
+		fputc('}', output);
+		add_tally(&total, &tally);
+		start = end;
+	} while (start < size || next < list.count);
+	fputs("],\"total\":{", output);
+	write_tally(output, &total);
+	fputs("}}\n", output);
+	diag_release(CU->diagnostics, list.labels);
+}
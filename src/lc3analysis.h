@@ -0,0 +1,9 @@
+#pragma once
+
+// Writes a JSON report on the code of a linked unit assembled with
+// `track_kinds` set (see analysis.txt). The code is split into blocks that
+// start at each labeled address; for each block and for the whole unit it
+// gives instruction counts by opcode and by InstructionFormat, the LD, LDI,
+// ST and STI counts, the branches that go backwards and an estimate of the
+// cycles it takes to run through once.
+void analysis_write(CompilationUnit *CU, const char *name, FILE *output);
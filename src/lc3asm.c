@@ -1,28 +1,27 @@
 #include "lc3asm.h"
 typedef struct Options {
 	FILE *input;
+	const char *input_name;
 	FILE *output;
 	VerbosityLevel verbosity;
+	const char *trace_path;
+	const char *server_path;
+	bool batch;
+	char **batch_paths;
+	size_t batch_count;
+	bool stats;
+	StatsFormat stats_format;
+	size_t error_limit;
+	size_t threads;
+	bool optimize;
+	size_t stream_limit;    // --stream: working memory bound in bytes; 0 when not streaming
+	const char *analysis_path;
+	bool dependencies;      // -MD: write a make rule next to the object
+	const char *target;     // -MT: the object named in that rule
 } Options;
 
-typedef struct Token {
-	TokenType type;
-	TokenData data;
-} Token;
-typedef struct Argument {
-	Token *tokens;
-	size_t count;
-} Argument;
-typedef struct Line {
-	Token *statement;
-	Argument *args;
-	size_t nArgs;
-	Token *label;
-	Token *comment;
-} Line;
-
 void parse_options(int argc, char *argv[], Options *options);
-void assemble(FILE *input, FILE *output);
+static char *read_input(FILE *input, size_t *length);
 
 int main(int argc, char *argv[]) {
 	log_init();
@@ -32,6 +31,7 @@ int main(int argc, char *argv[]) {
 
 	if (!options.input) {
 		options.input = stdin;
+		options.input_name = "<stdin>";
 	}
 	if (!options.output) {
 		options.output = stdout;
@@ -39,9 +39,81 @@ int main(int argc, char *argv[]) {
 	if (options.verbosity) {
 		log_config(options.verbosity, stderr);
 	}
+	if (options.stats) {
+#if LC3_STATS
+		stats_enable(options.stats_format, stderr);
+#else
+		LOGF_WARN("statistics were compiled out (LC3_STATS=0); ignoring -T");
+#endif
+	}
+	if (options.trace_path && !log_trace_open(options.trace_path)) {
+		LOGF_WARN("could not open trace file \"%s\"", options.trace_path);
+	}
+	if (options.server_path) {
+		return server_run(options.server_path);
+	}
+	if (options.batch) {
+		return batch_run(options.batch_paths, options.batch_count, options.error_limit, options.optimize, options.dependencies);
+	}
 
 	LOGF_TRACE("assemble start");
-	assemble(options.input, options.output);
+	LOG_SPAN_BEGIN("assemble", options.input_name);
+	char *source = NULL;
+	FILE *analysis = NULL;
+	if (options.analysis_path) {
+		analysis = fopen(options.analysis_path, "w");
+		if (!analysis) {
+			fprintf(stderr, "could not open file \"%s\"\n", options.analysis_path);
+			exit(FAILURE_IO);
+		}
+	}
+	Lc3AsmOptions asm_options = {
+		options.input_name,
+		options.error_limit,
+		NULL,
+		options.threads,
+		options.optimize,
+		analysis,
+		NULL,
+	};
+	Lc3AsmResult result;
+	int status;
+	if (options.stream_limit) {
+		if (fseek(options.output, 0, SEEK_CUR) != 0) {
+			FAILF(FAILURE_ARGS, "option --stream needs a seekable output; redirect it to a file\n");
+		}
+		status = lc3asm_assemble_stream(options.input, options.output, options.stream_limit, &asm_options, &result);
+		LOGF_INFO("peak working memory %zu of %zu bytes", result.peak_memory, options.stream_limit);
+	}
+	else {
+		size_t length;
+		source = read_input(options.input, &length);
+		status = lc3asm_assemble(source, length, &asm_options, &result);
+		if (options.optimize) {
+			LOGF_INFO("optimizer saved %zu words", result.words_saved);
+		}
+	}
+	if (result.diagnostic_count > 0) {
+		lc3asm_print_diagnostics(&result, stderr);
+	}
+	if (status == EXIT_SUCCESS && !options.stream_limit) {
+		fwrite(result.object, 1, result.object_size, options.output);
+		fflush(options.output);
+		if (ferror(options.output)) {
+			fputs("error while writing output\n", stderr);
+			status = FAILURE_IO;
+		}
+	}
+	if (analysis && fclose(analysis) != 0 && status == EXIT_SUCCESS) {
+		fputs("error while writing analysis\n", stderr);
+		status = FAILURE_IO;
+	}
+	if (options.dependencies && status == EXIT_SUCCESS) {
+		status = deps_write(options.target, options.input_name, result.includes, result.include_count);
+	}
+	lc3asm_result_free(&result);
+	free(source);
+	LOG_SPAN_END("assemble");
 	LOGF_TRACE("assemble complete");
 
 	LOGF_TRACE("cleanup");
@@ -52,13 +124,25 @@ int main(int argc, char *argv[]) {
 		fclose(options.output);
 	}
 	LOGF_TRACE("exit normal");
+	return status;
 }
 
+static void parse_stats_option(const char *arg, const char *value, Options *options) {
+	if (!stats_tryparse_format(value, &options->stats_format)) {
+		FAILF(FAILURE_ARGS, "option %s accepts no value, 'table' or 'json'\n", arg);
+	}
+	options->stats = true;
+}
 void parse_options(int argc, char *argv[], Options *options) {
+	enum {
+		DEFAULT_ERROR_LIMIT = 20,
+	};
+
 	if (argc < 1) {
 		FAILF(FAILURE_INTERNAL, "no callee?!");
 	}
 	memset(options, 0, sizeof(*options));
+	options->error_limit = DEFAULT_ERROR_LIMIT;
 
 	int i;
 	// process options
@@ -80,7 +164,62 @@ void parse_options(int argc, char *argv[], Options *options) {
 		}
 		else if (arg[1] == '-') {
 			// long-form argument can be `--option` or `--option=value`
-			FAILF(FAILURE_NOTIMPLEMENTED, "long-form argument not implemented (%s)\n", arg);
+			char *name = &arg[2];
+			char *value = strchr(name, '=');
+			size_t length = value ? (size_t)(value - name) : strlen(name);
+			if (value) {
+				value += 1;
+			}
+			if (length == 5 && strncmp(name, "stats", length) == 0) {
+				parse_stats_option("--stats", value, options);
+			}
+			else if (length == 5 && strncmp(name, "trace", length) == 0) {
+				if (!value || !value[0]) {
+					FAILF(FAILURE_ARGS, "option --trace expects a file name (--trace=<file>)\n");
+				}
+				options->trace_path = value;
+			}
+			else if (length == 6 && strncmp(name, "stream", length) == 0) {
+				enum {
+					DEFAULT_STREAM_LIMIT = 8192,
+				};
+				char *end;
+				unsigned long limit = value ? strtoul(value, &end, 10) : DEFAULT_STREAM_LIMIT;
+				if (value && (end == value || *end || limit == 0)) {
+					FAILF(
+						FAILURE_ARGS,
+						"option --stream expects a memory bound in bytes (--stream=<bytes>, one label per %d of them); got (%s)\n",
+						LC3ASM_STREAM_BYTES_PER_LABEL,
+						arg);
+				}
+				options->stream_limit = limit;
+			}
+			else if (length == 7 && strncmp(name, "analyze", length) == 0) {
+				if (!value || !value[0]) {
+					FAILF(FAILURE_ARGS, "option --analyze expects a file name (--analyze=<file>)\n");
+				}
+				options->analysis_path = value;
+			}
+			else if (length == 5 && strncmp(name, "batch", length) == 0 && !value) {
+				options->batch = true;
+			}
+			else if (length == 6 && strncmp(name, "server", length) == 0) {
+				if (!value || !value[0]) {
+					FAILF(FAILURE_ARGS, "option --server expects a socket path (--server=<path>)\n");
+				}
+				options->server_path = value;
+			}
+			else if (length == 11 && strncmp(name, "error-limit", length) == 0) {
+				char *end;
+				unsigned long limit = value ? strtoul(value, &end, 10) : 0;
+				if (!value || end == value || *end) {
+					FAILF(FAILURE_ARGS, "option --error-limit expects a count (0 for no limit); got (%s)\n", arg);
+				}
+				options->error_limit = limit;
+			}
+			else {
+				FAILF(FAILURE_ARGS, "unrecognized argument '%s'\n", arg);
+			}
 		}
 		else {
 			switch (arg[1]) {
@@ -101,12 +240,64 @@ void parse_options(int argc, char *argv[], Options *options) {
 					options->verbosity = level;
 					break;
 				}
+				case 'T':
+					parse_stats_option("-T", &arg[2], options);
+					break;
+				case 'O':
+					if (arg[2]) {
+						FAILF(FAILURE_ARGS, "option -O accepts no value; got (%s)\n", arg);
+					}
+					options->optimize = true;
+					break;
+				case 'M':
+					if (strcmp(arg, "-MD") == 0) {
+						options->dependencies = true;
+					}
+					else if (arg[2] == 'T' && arg[3]) {
+						options->target = &arg[3];
+					}
+					else {
+						FAILF(FAILURE_ARGS, "option -M expects -MD or -MT<target>; got (%s)\n", arg);
+					}
+					break;
+				case 'j': {
+					char *end;
+					unsigned long threads = strtoul(&arg[2], &end, 10);
+					if (end == &arg[2] || *end || threads == 0) {
+						FAILF(FAILURE_ARGS, "option -j expects a thread count (-j<N>); got (%s)\n", arg);
+					}
+					options->threads = threads;
+					break;
+				}
 				default:
 					FAILF(FAILURE_ARGS, "unrecognized argument '%s'\n", arg);
 			}
 		}
 	}
+	if (options->optimize && options->stream_limit) {
+		FAILF(FAILURE_ARGS, "option -O cannot be combined with --stream\n");
+	}
+	if (options->analysis_path && (options->stream_limit || options->batch)) {
+		FAILF(FAILURE_ARGS, "option --analyze cannot be combined with --stream or --batch\n");
+	}
+	if (options->dependencies && options->stream_limit) {
+		FAILF(FAILURE_ARGS, "option -MD cannot be combined with --stream\n");
+	}
+	if (options->target && (!options->dependencies || options->batch)) {
+		FAILF(FAILURE_ARGS, "option -MT needs -MD and a single input file\n");
+	}
 	// process filenames
+	if (options->batch) {
+		if (i == argc) {
+			FAILF(FAILURE_ARGS, "option --batch expects input files\n");
+		}
+		if (options->server_path) {
+			FAILF(FAILURE_ARGS, "option --server takes no input file; requests name their own\n");
+		}
+		options->batch_paths = &argv[i];
+		options->batch_count = argc - i;
+		return;
+	}
 	for (; i < argc; ++i) {
 		char *arg = argv[i];
 		if (options->input == NULL) {
@@ -116,554 +307,48 @@ void parse_options(int argc, char *argv[], Options *options) {
 				exit(FAILURE_ARGS);
 			}
 			options->input = fh;
+			options->input_name = arg;
 		}
 		else {
-			fputs("multiple filenames not supported yet.\n", stderr);
-			exit(FAILURE_NOTIMPLEMENTED);
-		}
-	}
-}
-
-int readline(FILE *file, char *buffer, size_t capacity);
-void free_token(Token *token);
-void process_line(CompilationUnit *CU, size_t line_number, Token *token, size_t nTokens);
-void assemble(FILE *input, FILE *output) {
-	enum {
-		MAX_LINE_CHARS = 4096,
-		MAX_LINE_TOKENS = 8,
-	};
-
-	char* line_chars = malloc(MAX_LINE_CHARS);
-	Token* line_tokens = malloc(MAX_LINE_TOKENS * sizeof(Token));
-	size_t line_number = 0;
-
-	if (!line_chars || !line_tokens) {
-		fputs("ran out of memory!\n", stderr);
-		exit(FAILURE_MEMORY);
-	}
-
-	CompilationUnit CU = {0};
-
-	LOGF_INFO("assemble");
-	LOGF_TRACE("file read");
-	while (!feof(input)) {
-		LOGF_TRACE("line read");
-		readline(input, line_chars, MAX_LINE_CHARS);
-		if (ferror(input)) {
-			fputs("error while reading file", stderr);
-			exit(FAILURE_IO);
-		}
-		line_number += 1;
-		char *cursor = line_chars;
-		size_t nTokens = 0;
-		LOGF_TRACE("line parse");
-		while (true) {
-			char *lexeme = next_lexeme(&cursor);
-			if (lexeme == NULL) {
-				lexeme = cursor; // lexeme is used to locate error in syntax_error
-				goto syntax_error;
-			}
-			else if (lexeme == cursor) {
-				// line is complete
-				break;
-			}
-			else {
-				Token *token = &line_tokens[nTokens++];
-				token->type = parse(lexeme, cursor - lexeme, &token->data);
-				if (token->type == TT_Invalid) {
-					goto syntax_error;
-				}
-			}
-
-			if (nTokens > MAX_LINE_TOKENS) {
-				fprintf(stderr, "too many tokens on line %zu\n", line_number);
-				exit(FAILURE_LIMITS);
-			}
-			continue;
-
-		syntax_error:
-			fprintf(
-				stderr,
-				"syntax error at offset %u:\n%s\n%*c\n",
-				(unsigned)(lexeme - line_chars),
-				line_chars,
-				(signed)(lexeme - line_chars + 1),
-				'^');
-			exit(FAILURE_SYNTAX);
-		}
-		LOGF_TRACE("line process");
-		process_line(&CU, line_number, line_tokens, nTokens);
-		LOGF_TRACE("line cleanup");
-		for (size_t i = 0; i < nTokens; ++i) {
-			free_token(&line_tokens[i]);
-		}
-	}
-
-	LOGF_TRACE("file cleanup");
-	free(line_chars);
-	free(line_tokens);
-
-	if (CU.origin_set) {
-		LOGF_INFO("produce obj");
-		cu_produce_obj(&CU, output);
-		exit(EXIT_SUCCESS);
-	}
-	else {
-		fputs("no code found!\n", stderr);
-		exit(FAILURE_SYNTAX);
-	}
-}
-
-void process_instruction(CompilationUnit *CU, Line *line);
-void process_word_literal(CompilationUnit *CU, Line *line);
-void process_directive(CompilationUnit *CU, Line *line);
-void process_line(CompilationUnit *CU, size_t line_number, Token *tokens, size_t nTokens) {
-	LOGF_TRACE("process line %zu (tokens: %p; nTokens: %zu)", line_number, (void*)tokens, nTokens);
-
-	enum {
-		MAX_ARGUMENTS = 5,
-	};
-
-	Line line = {0};
-	Argument args[MAX_ARGUMENTS] = {0};
-
-	// ignore empty lines
-	if (nTokens == 0) {
-		LOGF_TRACE("line empty");
-		return;
-	}
-
-	// handle comment
-	if (tokens[nTokens - 1].type == TT_Comment) {
-		line.comment = &tokens[nTokens - 1];
-		nTokens -= 1;
-	}
-	if (nTokens == 0) {
-		LOGF_TRACE("line empty");
-		return;
-	}
-
-	// handle label
-	if (tokens[0].type == TT_Identifier) {
-		line.label = &tokens[0];
-		tokens += 1;
-		nTokens -= 1;
-		if (nTokens == 0) {
-			fprintf(stderr, "dangling label on line %zu\n", line_number);
-			exit(FAILURE_SYNTAX);
-		}
-	}
-
-	// handle statement
-	line.statement = &tokens[0];
-	tokens += 1;
-	nTokens -= 1;
-
-	// handle arguments
-	LOGF_TRACE("arguments");
-	if (nTokens > 0) {
-		if (tokens[nTokens - 1].type == TT_Comma) {
-			fputs("dangling comma\n", stderr);
-			exit(FAILURE_SYNTAX);
-		}
-		line.args = args;
-		size_t nArgs = 0;
-		Token *last = tokens;
-		for (size_t i = 0; i < nTokens; ++i) {
-			if (tokens[i].type == TT_Comma) {
-				if (nArgs >= MAX_ARGUMENTS) {
-					break;
-				}
-				line.args[nArgs++] = (Argument){ last, &tokens[i] - last };
-				last = &tokens[i + 1];
-			}
-		}
-		if (nArgs >= MAX_ARGUMENTS) {
-			fputs("too many arguments on one line\n", stderr);
-			exit(FAILURE_LIMITS);
-		}
-		line.args[nArgs++] = (Argument){ last, &tokens[nTokens] - last };
-		line.nArgs = nArgs;
-	}
-	else {
-		line.args = NULL;
-		line.nArgs = 0;
-	}
-
-	// process line
-	switch (line.statement->type) {
-		case TT_Instruction:
-			process_instruction(CU, &line);
-			break;
-		case TT_WordLiteral:
-			process_word_literal(CU, &line);
-			break;
-		case TT_Directive:
-			process_directive(CU, &line);
-			break;
-		default:
-			fprintf(stderr, "expecting instruction or directive on line %zu\n", line_number);
-			exit(FAILURE_SYNTAX);
-			break;
-	}
-}
-static void expect_n_args(size_t expected, size_t actual);
-static int expect_reg(Argument *arg, const char *name);
-static long expect_off(CompilationUnit *CU, Argument *arg, size_t bits, const char *name);
-static int try_reg(Argument *arg);
-static int try_imm(Argument *arg, size_t bits, bool errorOnTooLarge);
-static bool validate_imm(long number, size_t nBits);
-void emit_preamble(CompilationUnit *CU, size_t alignment, Token *label);
-void process_instruction(CompilationUnit *CU, Line *line) {
-	LOGF_TRACE("instruction");
-	Token *instruction = line->statement;
-	Argument *args = line->args;
-	size_t nArgs = line->nArgs;
-	if (instruction->data.dataType != TDT_InstructionMeta) {
-		fprintf(stderr, "expecting instruction; got (%u)\n", instruction->data.dataType);
-		exit(FAILURE_INTERNAL);
-	}
-	InstructionMeta *meta = &instruction->data.instruction_meta;
-	uint16_t word = meta->instruction_mask;
-	emit_preamble(CU, 1, line->label);
-	switch (meta->format) {
-		case IF_Arithmetic: {
-			expect_n_args(3, nArgs);
-			int dest = expect_reg(&args[0], "first");
-			int lhs = expect_reg(&args[1], "second");
-			int rhs = try_reg(&args[2]);
-			if (rhs < 0) {
-				rhs = try_imm(&args[2], 5, true);
-				if (rhs < 0) {
-					fprintf(
-						stderr,
-						"expecting register or immediate as third argument; found (%u)\n",
-						args[2].count == 1 ? args[2].tokens[0].type : (TokenType)0);
-					exit(FAILURE_SYNTAX);
-				}
-				rhs |= 0x20;
-			}
-			word |= dest << 9;
-			word |= lhs << 6;
-			word |= rhs;
-			break;
-		}
-		case IF_DestOffset: {
-			expect_n_args(2, nArgs);
-			int dest = expect_reg(&args[0], "first");
-			long offset = expect_off(CU, &args[1], 9, "second");
-			word |= dest << 9;
-			word |= offset;
-			break;
-		}
-		case IF_Offset9: {
-			expect_n_args(1, nArgs);
-			long offset = expect_off(CU, &args[0], 9, "first");
-			word |= offset;
-			break;
-		}
-		case IF_BaseR: {
-			expect_n_args(1, nArgs);
-			int dest = expect_reg(&args[0], "first");
-			word |= dest << 6;
-			break;
-		}
-		default:
-			fprintf(stderr, "unrecognized instruction format (%u)\n", meta->format);
-			exit(FAILURE_INTERNAL);
-			break;
-	}
-	cu_emit_word(CU, word);
-}
-static void expect_n_args(size_t expected, size_t actual) {
-	if (actual != expected) {
-		fprintf(stderr, "expecting %zu arguments; found %zu\n", expected, actual);
-		exit(FAILURE_SYNTAX);
-	}
-}
-static int expect_reg(Argument* arg, const char *name) {
-	int index = try_reg(arg);
-	if (index < 0) {
-		fprintf(stderr, "expecting register as %s argument\n", name);
-		exit(FAILURE_SYNTAX);
-	}
-	return index;
-}
-static long expect_off(CompilationUnit *CU, Argument *arg, size_t nBits, const char *name) {
-	long offset = try_imm(arg, nBits, true);
-	if (offset < 0) {
-		if (arg->count == 1 && arg->tokens[0].type == TT_Identifier) {
-			StringSlice slice = tokendata_expect_string(&arg->tokens[0].data);
-			uint16_t target;
-			if (cu_label_get_target(CU, slice.start, slice.length, &target)) {
-				offset = 1L + target - cu_cursor_get(CU);
-				if (!validate_imm(offset, nBits)) {
-					fprintf(
-						stderr,
-						"offset for label %.*s (%li) does not fit in %zu bits\n",
-						(unsigned)slice.length,
-						slice.start,
-						offset,
-						nBits);
-					exit(FAILURE_SYNTAX);
-				}
-			}
-			else {
-				cu_late_link(CU, cu_cursor_get(CU), LLT_OffsetPlusOneImm9, slice.start, slice.length);
-				offset = 0;
-			}
-		}
-		else {
-			fprintf(
-				stderr,
-				"expecting symbol or number as %s argument; found (%u)\n",
-				name,
-				arg->count == 1 ? arg->tokens[0].type : (TokenType)0);
-			exit(FAILURE_SYNTAX);
-		}
-	}
-	return offset & ~(~0ul << nBits);
-}
-static int try_reg(Argument *arg) {
-	if (arg->count == 0) {
-		return -1;
-	}
-	if (arg->count > 1) {
-		fputs("multiple token arg\n", stderr);
-		exit(FAILURE_NOTIMPLEMENTED);
-	}
-	Token *token = &arg->tokens[0];
-	if (token->type != TT_Register) {
-		return -1;
-	}
-	if (token->data.dataType != TDT_Integer) {
-		fprintf(stderr, "unexpected register data type (%u)", token->data.dataType);
-		exit(FAILURE_INTERNAL);
-	}
-	int index = token->data.integer;
-	if (index < 0 || index > 7) {
-		fprintf(stderr, "register value out of range (%i)\n", index);
-		exit(FAILURE_INTERNAL);
-	}
-	return index;
-}
-static int try_imm(Argument *arg, size_t nBits, bool errorOnTooLarge) {
-	if (arg->count == 0) {
-		return -1;
-	}
-	if (arg->count > 1) {
-		fputs("multiple token arg\n", stderr);
-		exit(FAILURE_NOTIMPLEMENTED);
-	}
-	Token *token = &arg->tokens[0];
-	if (nBits <= 1 || nBits > 12) {
-		fprintf(stderr, "nBits out of range (%zu)\n", nBits);
-		exit(FAILURE_INTERNAL);
-	}
-	if (token->type != TT_Number) {
-		return -1;
-	}
-	if (token->data.dataType != TDT_Integer) {
-		fprintf(stderr, "unexpected number data type (%u)", token->data.dataType);
-		exit(FAILURE_INTERNAL);
-	}
-	int number = token->data.integer;
-	unsigned long mask = ~0ul << nBits;
-	if (number & mask && ~number & mask) {
-		if (errorOnTooLarge) {
-			fprintf(stderr, "number (%i) does not fit in %zu bits\n", number, nBits);
-			exit(FAILURE_SYNTAX);
-		}
-		else {
-			return -1;
-		}
-	}
-	return number & ~mask;
-}
-static bool try_int(Argument *arg, long *result) {
-	if (arg->count == 0) {
-		return false;
-	}
-	if (arg->count > 1) {
-		fputs("multiple token arg\n", stderr);
-		exit(FAILURE_NOTIMPLEMENTED);
-	}
-	Token *token = &arg->tokens[0];
-	switch (token->type) {
-		case TT_Number:
-			if (token->data.dataType != TDT_Integer) {
-				fprintf(stderr, "unexpected number data type (%u)", token->data.dataType);
-				exit(FAILURE_INTERNAL);
-			}
-			*result = token->data.integer;
-			return true;
-		case TT_HexIdentifier: {
-			StringSlice string = tokendata_expect_string(&token->data);
-			char *end;
-			unsigned long value = strtoul(string.start, &end, 16);
-			if (end != string.start + string.length || value >= 0x7FFFFFFF) {
-				fputs("bad hex integer", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			*result = (long)value;
-			return true;
-		}
-		default:
-			return false;
-	}
-}
-static bool validate_imm(long number, size_t nBits) {
-	unsigned long mask = ~0ul << nBits;
-	return !(number & mask && ~number & mask);
-}
-void process_word_literal(CompilationUnit *CU, Line *line) {
-	LOGF_TRACE("word literal");
-	emit_preamble(CU, 1, line->label);
-	cu_emit_word(CU, line->statement->data.word);
-}
-void process_directive(CompilationUnit *CU, Line *line) {
-	LOGF_TRACE("directive");
-
-	Token *directive = line->statement;
-	Argument *args = line->args;
-	size_t nArgs = line->nArgs;
-	Token *label = line->label;
-	if (directive->data.dataType != TDT_DirectiveType) {
-		fprintf(stderr, "expecting directive; got (%u)\n", directive->data.dataType);
-		exit(FAILURE_INTERNAL);
-	}
-	switch (directive->data.directive_type) {
-		case DT_Origin: {
-			LOGF_TRACE(".origin");
-			if (label) {
-				fputs(".origin cannot have a label\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			if (nArgs != 1) {
-				fputs(".origin expects exactly one argument\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			Argument *arg = args;
-			long number;
-			if (!try_int(arg, &number)) {
-				fputs(".origin expects a number between [0 .. 0xFFFF]\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			if (number < 0 || number > 0xFFFF) {
-				fprintf(stderr, ".origin expects a number between between [0 .. 0xFFFF]; got %li\n", number);
-				exit(FAILURE_SYNTAX);
-			}
-			uint16_t origin = (uint16_t)number;
-			if (!cu_origin_set(CU, origin)) {
-				fputs(".origin was already set\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			break;
-		}
-		case DT_StringZ: {
-			LOGF_TRACE(".stringz");
-			if (nArgs != 1) {
-				fputs(".stringz expects exactly one argument\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			Argument *arg = args;
-			if (arg->count == 0) {
-				fputs("empty argument\n", stderr);
-				exit(FAILURE_SYNTAX);
-			}
-			if (arg->count > 1) {
-				fputs("multiple token arg\n", stderr);
-				exit(FAILURE_NOTIMPLEMENTED);
-			}
-			StringSlice slice = tokendata_expect_string(&args->tokens[0].data);
-			emit_preamble(CU, 1, line->label);
-			cu_emit_bytes(CU, (uint8_t*)slice.start, slice.length);
-			cu_emit_word(CU, 0);
-			break;
+			fputs("multiple filenames need --batch.\n", stderr);
+			exit(FAILURE_ARGS);
 		}
-		default:
-			fprintf(stderr, "unrecognized directive type (%u)\n", directive->data.directive_type);
-			exit(FAILURE_INTERNAL);
 	}
-}
-void emit_preamble(CompilationUnit *CU, size_t alignment, Token *label) {
-	cu_align_to(CU, alignment);
-	if (label) {
-		StringSlice slice = tokendata_expect_string(&label->data);
-		cu_register_label(CU, slice.start, slice.length, cu_cursor_get(CU));
+	if (options->server_path && options->input) {
+		FAILF(FAILURE_ARGS, "option --server takes no input file; requests name their own\n");
 	}
-}
-
-void free_token(Token *token) {
-	if (!token) {
-		return;
-	}
-
-	free_tokendata(&token->data);
-}
-void print_tokendata(TokenData *data) {
-	switch (data->dataType) {
-		case TDT_Void:
-			break;
-		case TDT_Word:
-			fprintf(stderr, "%04X", data->word);
-			break;
-		case TDT_Integer:
-			fprintf(stderr, "%ld", data->integer);
-			break;
-		case TDT_Size:
-			fprintf(stderr, "%zu", data->size);
-			break;
-		case TDT_Pointer:
-		case TDT_PointerOwned:
-			fprintf(stderr, "%p", data->pointer);
-			break;
-		case TDT_String:
-		case TDT_StringOwned:
-			fprintf(stderr, "%s", data->string);
-			break;
-		case TDT_StringSlice: {
-			StringSlice slice = data->string_slice;
-			fprintf(stderr, "%.*s", (int)slice.length, slice.start);
-			break;
-		}
-		case TDT_InstructionMeta: {
-			InstructionMeta *meta = &data->instruction_meta;
-			fprintf(stderr, "%04X(%i)", meta->instruction_mask, meta->format);
-			break;
-		}
-		default:
-			fputs("!bad data!", stderr);
-			break;
+	if (options->dependencies && !options->server_path && !options->input) {
+		FAILF(FAILURE_ARGS, "option -MD needs an input file\n");
 	}
 }
 
-int readline(FILE *file, char *buffer, size_t capacity) {
-	size_t i = 0;
+static char *read_input(FILE *input, size_t *length) {
+	STATS_CLOCK(clock);
+	size_t capacity = 1 << 16;
+	size_t size = 0;
+	char *buffer = NULL;
 	while (true) {
-		if (i >= capacity) {
-			fputs("line too long\n", stderr);
-			exit(FAILURE_LIMITS);
-		}
-		
-		int c = fgetc(file);
-		if (c < 0) {
-			if (!feof(file)) {
-				fputs("io error\n", stderr);
-				exit(FAILURE_IO);
+		if (!buffer || size == capacity) {
+			capacity = buffer ? capacity * 2 : capacity;
+			char *grown = realloc(buffer, capacity);
+			if (!grown) {
+				fputs("ran out of memory!\n", stderr);
+				exit(FAILURE_MEMORY);
 			}
-			break;
+			STATS_COUNT(SC_Mallocs, 1);
+			buffer = grown;
 		}
-		if (c == '\n' || c == '\r') {
-			int nc = fgetc(file);
-			if (nc >= 0 && (nc == c || (nc != '\n' && nc != '\r'))) {
-				ungetc(nc, file);
-			}
+		size_t count = fread(buffer + size, 1, capacity - size, input);
+		size += count;
+		if (count == 0) {
 			break;
 		}
-		buffer[i++] = c;
 	}
-	buffer[i] = 0;
-	return i;
+	if (ferror(input)) {
+		fputs("error while reading file\n", stderr);
+		exit(FAILURE_IO);
+	}
+	STATS_LAP(clock, SP_Read);
+	*length = size;
+	return buffer;
 }
-
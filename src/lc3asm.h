@@ -3,6 +3,7 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -11,10 +12,19 @@
 #include <string.h>
 #include <time.h>
 
+#include "liblc3asm.h"
 #include "lc3log.h"
+#include "lc3stats.h"
+#include "lc3diag.h"
 #include "lc3lex.h"
 #include "lc3tok.h"
+#include "lc3map.h"
 #include "lc3cu.h"
+#include "lc3opt.h"
+#include "lc3analysis.h"
+#include "lc3server.h"
+#include "lc3batch.h"
+#include "lc3deps.h"
 
 enum {
 	FAILURE_ARGS = 1,
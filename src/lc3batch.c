@@ -0,0 +1,277 @@
+#include "lc3std.h"
+#include "lc3log.h"
+#include "lc3stats.h"
+#include "liblc3asm.h"
+#include "lc3batch.h"
+#include "lc3deps.h"
+
+#include <threads.h>
+
+// Files go through four stages, each on its own thread and connected by
+// bounded queues: while file N is encoded, file N+1 is being lexed, N+2 read
+// and N-1 written. Every stage takes the files in order, so the diagnostics
+// and objects come out in the order the files were given.
+
+enum {
+	BATCH_QUEUE_DEPTH = 2,
+};
+
+typedef struct BatchFile {
+	const char *path;
+	char *source;
+	size_t length;
+	int error;              // set when the file could not be read
+	bool dependencies;      // write a make rule next to the object
+	Lc3AsmOptions options;
+	Lc3AsmParsed *parsed;   // NULL if lc3asm_parse() ran out of memory
+	Lc3AsmResult result;
+} BatchFile;
+
+typedef struct Queue {
+	BatchFile *items[BATCH_QUEUE_DEPTH];
+	size_t head;
+	size_t count;
+	mtx_t lock;
+	cnd_t changed;
+} Queue;
+
+// A stage without input takes the files straight from the batch.
+typedef struct Stage {
+	Queue *input;
+	Queue *output;
+	StatsStage stage;
+	void (*work)(BatchFile *file);
+	BatchFile *files;
+	size_t count;
+} Stage;
+
+static const char *g_span_names[SS_CountPlusOne] = {
+	[SS_Read] = "read",
+	[SS_Lex] = "lex",
+	[SS_Encode] = "encode",
+	[SS_Write] = "write",
+	[SS_Pipeline] = "batch",
+};
+
+static bool queue_init(Queue *queue) {
+	memset(queue, 0, sizeof(*queue));
+	if (mtx_init(&queue->lock, mtx_plain) != thrd_success) {
+		return false;
+	}
+	if (cnd_init(&queue->changed) != thrd_success) {
+		mtx_destroy(&queue->lock);
+		return false;
+	}
+	return true;
+}
+static void queue_destroy(Queue *queue) {
+	cnd_destroy(&queue->changed);
+	mtx_destroy(&queue->lock);
+}
+// NULL marks the end of the batch.
+static void queue_push(Queue *queue, BatchFile *file) {
+	mtx_lock(&queue->lock);
+	while (queue->count == BATCH_QUEUE_DEPTH) {
+		cnd_wait(&queue->changed, &queue->lock);
+	}
+	queue->items[(queue->head + queue->count++) % BATCH_QUEUE_DEPTH] = file;
+	cnd_broadcast(&queue->changed);
+	mtx_unlock(&queue->lock);
+}
+static BatchFile *queue_pop(Queue *queue) {
+	mtx_lock(&queue->lock);
+	while (queue->count == 0) {
+		cnd_wait(&queue->changed, &queue->lock);
+	}
+	BatchFile *file = queue->items[queue->head];
+	queue->head = (queue->head + 1) % BATCH_QUEUE_DEPTH;
+	queue->count -= 1;
+	cnd_broadcast(&queue->changed);
+	mtx_unlock(&queue->lock);
+	return file;
+}
+
+static void read_file(BatchFile *file) {
+	FILE *input = fopen(file->path, "rb");
+	if (!input) {
+		file->error = FAILURE_ARGS;
+		return;
+	}
+	size_t capacity = 1 << 16;
+	char *buffer = NULL;
+	while (true) {
+		if (!buffer || file->length == capacity) {
+			capacity = buffer ? capacity * 2 : capacity;
+			char *grown = realloc(buffer, capacity);
+			if (!grown) {
+				file->error = FAILURE_MEMORY;
+				break;
+			}
+			buffer = grown;
+		}
+		size_t count = fread(buffer + file->length, 1, capacity - file->length, input);
+		file->length += count;
+		if (count == 0) {
+			break;
+		}
+	}
+	if (!file->error && ferror(input)) {
+		file->error = FAILURE_IO;
+	}
+	fclose(input);
+	if (file->error) {
+		free(buffer);
+		buffer = NULL;
+	}
+	file->source = buffer;
+}
+static void lex_file(BatchFile *file) {
+	if (!file->error) {
+		file->parsed = lc3asm_parse(file->source, file->length, &file->options);
+	}
+}
+static void encode_file(BatchFile *file) {
+	if (file->error) {
+		return;
+	}
+	if (file->parsed) {
+		lc3asm_encode(file->parsed, &file->result);
+	}
+	else {
+		lc3asm_assemble(file->source, file->length, &file->options, &file->result);
+	}
+	free(file->source);
+	file->source = NULL;
+}
+// Returns the status of the file.
+static int write_file(BatchFile *file) {
+	switch (file->error) {
+		case 0:
+			break;
+		case FAILURE_ARGS:
+			fprintf(stderr, "could not open file \"%s\"\n", file->path);
+			return file->error;
+		case FAILURE_MEMORY:
+			fputs("ran out of memory!\n", stderr);
+			return file->error;
+		default:
+			fprintf(stderr, "error while reading file \"%s\"\n", file->path);
+			return file->error;
+	}
+
+	int status = file->result.status;
+	if (file->result.diagnostic_count > 0) {
+		lc3asm_print_diagnostics(&file->result, stderr);
+	}
+	if (status == EXIT_SUCCESS) {
+		// "name.asm" becomes "name.obj"; any other name gets ".obj" appended
+		char *path = deps_rename(file->path, ".asm", ".obj");
+		FILE *output = fopen(path, "wb");
+		if (!output) {
+			fprintf(stderr, "could not open file \"%s\"\n", path);
+			status = FAILURE_IO;
+		}
+		else {
+			fwrite(file->result.object, 1, file->result.object_size, output);
+			STATS_COUNT(SC_BytesWritten, file->result.object_size);
+			if (fclose(output) != 0) {
+				fprintf(stderr, "error while writing file \"%s\"\n", path);
+				status = FAILURE_IO;
+			}
+		}
+		if (status == EXIT_SUCCESS && file->dependencies) {
+			status = deps_write(path, file->path, file->result.includes, file->result.include_count);
+		}
+		free(path);
+	}
+	lc3asm_result_free(&file->result);
+	return status;
+}
+
+static int run_stage(void *arg) {
+	Stage *stage = arg;
+	size_t next = 0;
+	while (true) {
+		BatchFile *file = NULL;
+		if (stage->input) {
+			file = queue_pop(stage->input);
+		}
+		else if (next < stage->count) {
+			file = &stage->files[next++];
+		}
+		if (!file) {
+			break;
+		}
+		LOG_SPAN_BEGIN(g_span_names[stage->stage], file->path);
+		STATS_CLOCK(clock);
+		stage->work(file);
+		STATS_STAGE_LAP(clock, stage->stage);
+		LOG_SPAN_END(g_span_names[stage->stage]);
+		queue_push(stage->output, file);
+	}
+	queue_push(stage->output, NULL);
+	return 0;
+}
+
+int batch_run(char *const *paths, size_t count, size_t error_limit, bool optimize, bool dependencies) {
+	enum {
+		STAGE_THREADS = 3,
+	};
+
+	BatchFile *files = calloc(count, sizeof(BatchFile));
+	if (!files) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		files[i].path = paths[i];
+		files[i].dependencies = dependencies;
+		files[i].options = (Lc3AsmOptions){ paths[i], error_limit, NULL, 0, optimize, NULL, NULL };
+	}
+	Queue queues[STAGE_THREADS];
+	for (size_t i = 0; i < STAGE_THREADS; ++i) {
+		if (!queue_init(&queues[i])) {
+			fputs("could not create batch queues\n", stderr);
+			exit(FAILURE_INTERNAL);
+		}
+	}
+	Stage stages[STAGE_THREADS] = {
+		{ NULL, &queues[0], SS_Read, read_file, files, count },
+		{ &queues[0], &queues[1], SS_Lex, lex_file, NULL, 0 },
+		{ &queues[1], &queues[2], SS_Encode, encode_file, NULL, 0 },
+	};
+
+	LOGF_INFO("batch: %zu files", count);
+	LOG_SPAN_BEGIN(g_span_names[SS_Pipeline], NULL);
+	STATS_CLOCK(pipeline);
+	thrd_t threads[STAGE_THREADS];
+	for (size_t i = 0; i < STAGE_THREADS; ++i) {
+		if (thrd_create(&threads[i], run_stage, &stages[i]) != thrd_success) {
+			// the queues are bounded, so no stage can run here instead
+			fputs("could not start batch threads\n", stderr);
+			exit(FAILURE_INTERNAL);
+		}
+	}
+
+	// this thread is the write stage
+	int status = EXIT_SUCCESS;
+	BatchFile *file;
+	while ((file = queue_pop(&queues[STAGE_THREADS - 1]))) {
+		LOG_SPAN_BEGIN(g_span_names[SS_Write], file->path);
+		STATS_CLOCK(clock);
+		int file_status = write_file(file);
+		STATS_STAGE_LAP(clock, SS_Write);
+		LOG_SPAN_END(g_span_names[SS_Write]);
+		if (status == EXIT_SUCCESS) {
+			status = file_status;
+		}
+	}
+	for (size_t i = 0; i < STAGE_THREADS; ++i) {
+		thrd_join(threads[i], NULL);
+		queue_destroy(&queues[i]);
+	}
+	STATS_STAGE_LAP(pipeline, SS_Pipeline);
+	LOG_SPAN_END(g_span_names[SS_Pipeline]);
+	free(files);
+	return status;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// Assembles each of `paths` into a file of the same name ending in ".obj",
+// and with `dependencies` writes a make rule for it next to it, ending in
+// ".d"; returns the status of the first file that failed, or 0.
+int batch_run(char *const *paths, size_t count, size_t error_limit, bool optimize, bool dependencies);
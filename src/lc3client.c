@@ -0,0 +1,249 @@
+#define _XOPEN_SOURCE 700
+
+#include "lc3std.h"
+#include "lc3wire.h"
+#include "lc3deps.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Thin client for `lc3asm --server`: takes the arguments of lc3asm that apply
+// to a single file, sends the request to the server named by --socket or
+// LC3_SERVER and writes the server's diagnostics and object exactly as lc3asm
+// would have.
+
+typedef struct Options {
+	const char *socket_path;
+	const char *input_path;
+	uint32_t error_limit;
+	uint16_t flags;         // WireRequestFlags
+	bool dependencies;      // -MD: write a make rule next to the object
+	const char *target;     // -MT: the object named in that rule
+} Options;
+
+static void parse_options(int argc, char *argv[], Options *options) {
+	enum {
+		DEFAULT_ERROR_LIMIT = 20,
+	};
+
+	*options = (Options){ getenv("LC3_SERVER"), NULL, DEFAULT_ERROR_LIMIT, 0, false, NULL };
+	int i;
+	for (i = 1; i < argc; ++i) {
+		char *arg = argv[i];
+		if (strcmp(arg, "--") == 0) {
+			i += 1;
+			break;
+		}
+		else if (arg[0] != '-' || arg[1] == 0) {
+			break;
+		}
+		else if (strncmp(arg, "--socket=", 9) == 0 && arg[9]) {
+			options->socket_path = &arg[9];
+		}
+		else if (strncmp(arg, "--error-limit=", 14) == 0) {
+			char *end;
+			unsigned long limit = strtoul(&arg[14], &end, 10);
+			if (end == &arg[14] || *end || limit > UINT32_MAX) {
+				fprintf(stderr, "option --error-limit expects a count (0 for no limit); got (%s)\n", arg);
+				exit(FAILURE_ARGS);
+			}
+			options->error_limit = limit;
+		}
+		else if (strcmp(arg, "-O") == 0) {
+			options->flags |= WRF_Optimize;
+		}
+		else if (strcmp(arg, "-MD") == 0) {
+			options->dependencies = true;
+			options->flags |= WRF_Dependencies;
+		}
+		else if (strncmp(arg, "-MT", 3) == 0 && arg[3]) {
+			options->target = &arg[3];
+		}
+		else if (arg[1] == 'M') {
+			fprintf(stderr, "option -M expects -MD or -MT<target>; got (%s)\n", arg);
+			exit(FAILURE_ARGS);
+		}
+		else if (strncmp(arg, "--analyze", 9) == 0 && (arg[9] == 0 || arg[9] == '=')) {
+			// the report is written by the assembling process
+			fputs("option --analyze is not supported by the server; run lc3asm --analyze instead\n", stderr);
+			exit(FAILURE_NOTIMPLEMENTED);
+		}
+		else if (arg[1] == 'v' || arg[1] == 'T' || arg[1] == 'j' || strncmp(arg, "--stats", 7) == 0 || strncmp(arg, "--trace=", 8) == 0) {
+			// these configure the server process, not a request
+			fprintf(stderr, "note: '%s' is not forwarded to the server; ignored\n", arg);
+		}
+		else {
+			fprintf(stderr, "unrecognized argument '%s'\n", arg);
+			exit(FAILURE_ARGS);
+		}
+	}
+	for (; i < argc; ++i) {
+		if (options->input_path) {
+			fputs("multiple filenames not supported yet.\n", stderr);
+			exit(FAILURE_NOTIMPLEMENTED);
+		}
+		options->input_path = argv[i];
+	}
+	if (options->target && !options->dependencies) {
+		fputs("option -MT needs -MD and a single input file\n", stderr);
+		exit(FAILURE_ARGS);
+	}
+	if (options->dependencies && !options->input_path) {
+		fputs("option -MD needs an input file\n", stderr);
+		exit(FAILURE_ARGS);
+	}
+	if (!options->socket_path || !options->socket_path[0]) {
+		fputs("no server socket; pass --socket=<path> or set LC3_SERVER\n", stderr);
+		exit(FAILURE_ARGS);
+	}
+}
+
+static char *read_stdin(size_t *length) {
+	size_t capacity = 1 << 16;
+	size_t size = 0;
+	char *buffer = malloc(capacity);
+	while (buffer) {
+		size += fread(buffer + size, 1, capacity - size, stdin);
+		if (size < capacity) {
+			break;
+		}
+		capacity *= 2;
+		char *grown = realloc(buffer, capacity);
+		if (!grown) {
+			free(buffer);
+		}
+		buffer = grown;
+	}
+	if (!buffer) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	if (ferror(stdin)) {
+		fputs("error while reading file\n", stderr);
+		exit(FAILURE_IO);
+	}
+	*length = size;
+	return buffer;
+}
+
+static int connect_server(const char *path) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "socket path too long \"%s\"\n", path);
+		exit(FAILURE_ARGS);
+	}
+	strcpy(address.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+		fprintf(stderr, "could not connect to lc3asm server at \"%s\"\n", path);
+		exit(FAILURE_IO);
+	}
+	return fd;
+}
+
+// Writes the rule for the NUL-terminated paths in `includes` as lc3asm -MD
+// would.
+static int write_dependencies(const Options *options, char *includes, size_t size) {
+	size_t count = 0;
+	for (size_t i = 0; i < size; ++i) {
+		count += includes[i] == 0;
+	}
+	char **paths = malloc((count ? count : 1) * sizeof(char*));
+	if (!paths) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	size_t start = 0;
+	for (size_t i = 0, n = 0; i < size; ++i) {
+		if (includes[i] == 0) {
+			paths[n++] = &includes[start];
+			start = i + 1;
+		}
+	}
+	int status = deps_write(options->target, options->input_path, paths, count);
+	free(paths);
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	parse_options(argc, argv, &options);
+
+	WireRequestKind kind;
+	const char *name;
+	char *payload;
+	size_t payload_length;
+	if (options.input_path) {
+		// the server has its own working directory
+		kind = WRK_Path;
+		name = options.input_path;
+		payload = realpath(options.input_path, NULL);
+		if (!payload) {
+			fprintf(stderr, "could not open file \"%s\"\n", options.input_path);
+			exit(FAILURE_ARGS);
+		}
+		payload_length = strlen(payload);
+	}
+	else {
+		kind = WRK_Source;
+		name = "<stdin>";
+		payload = read_stdin(&payload_length);
+	}
+	size_t name_length = strlen(name);
+	if (name_length > WIRE_MAX_NAME || payload_length > WIRE_MAX_PAYLOAD) {
+		fputs("input too large for the server\n", stderr);
+		exit(FAILURE_LIMITS);
+	}
+
+	int fd = connect_server(options.socket_path);
+	uint8_t header[WIRE_RESPONSE_SIZE] = { 'L', 'C', '3', 'Q', WIRE_VERSION, kind };
+	wire_put_u16(&header[6], options.flags);
+	wire_put_u32(&header[8], options.error_limit);
+	wire_put_u32(&header[12], name_length);
+	wire_put_u32(&header[16], payload_length);
+	if (!wire_write(fd, header, WIRE_REQUEST_SIZE)
+		|| !wire_write(fd, name, name_length)
+		|| !wire_write(fd, payload, payload_length)
+		|| !wire_read(fd, header, WIRE_RESPONSE_SIZE)
+		|| memcmp(header, "LC3P", 4) != 0
+		|| header[4] != WIRE_VERSION) {
+		fputs("lost connection to lc3asm server\n", stderr);
+		exit(FAILURE_IO);
+	}
+	free(payload);
+
+	int status = (int)wire_get_u32(&header[8]);
+	size_t sizes[] = { wire_get_u32(&header[12]), wire_get_u32(&header[16]), wire_get_u32(&header[20]) };
+	FILE *targets[] = { stderr, stdout, NULL };
+	char *includes = NULL;
+	for (size_t i = 0; i < 3; ++i) {
+		char *buffer = malloc(sizes[i] ? sizes[i] : 1);
+		if (!buffer) {
+			fputs("ran out of memory!\n", stderr);
+			exit(FAILURE_MEMORY);
+		}
+		if (!wire_read(fd, buffer, sizes[i])) {
+			fputs("lost connection to lc3asm server\n", stderr);
+			exit(FAILURE_IO);
+		}
+		if (targets[i]) {
+			fwrite(buffer, 1, sizes[i], targets[i]);
+			free(buffer);
+		}
+		else {
+			includes = buffer;
+		}
+	}
+	close(fd);
+	fflush(stdout);
+	if (ferror(stdout)) {
+		fputs("error while writing output\n", stderr);
+		status = FAILURE_IO;
+	}
+	if (options.dependencies && status == EXIT_SUCCESS) {
+		status = write_dependencies(&options, includes, sizes[2]);
+	}
+	free(includes);
+	return status;
+}
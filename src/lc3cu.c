@@ -1,5 +1,10 @@
 #include "lc3asm.h"
 
+enum {
+	HEADER_SIZE = 32,
+	STREAM_WINDOW_WORDS = 128,
+};
+
 typedef struct LabelNode {
 	char *name;
 	size_t length;
@@ -10,66 +15,130 @@ typedef struct LabelNode {
 typedef struct LateLinkingNode {
 	LateLinkingType type;
 	uint16_t address;
+	uint16_t word;      // streaming: the word to patch once it has left the window
 	char *name;
 	size_t length;
+	size_t line;
+	size_t column;
+	const char *file;   // Diagnostics.include of the line; outlives the unit
 	struct LateLinkingNode *next;
+	struct LateLinkingNode **link;          // streaming: the pointer to this node, to unlink it
+	struct LateLinkingNode *next_waiting;   // streaming: the next reference to the same name
 } LateLinkingNode;
 
-static char* malloc_string_copy(const char *start, size_t length) {
-	char *buffer = malloc(sizeof(length));
-	if (!buffer) {
-		fputs("ran out of memory!\n", stderr);
-		exit(FAILURE_MEMORY);
-	}
+static char* malloc_string_copy(CompilationUnit *CU, const char *start, size_t length) {
+	char *buffer = diag_alloc(CU->diagnostics, length);
 	for (size_t i = 0; i < length; ++i) {
 		buffer[i] = start[i];
 	}
 	return buffer;
 }
 
+static size_t hash_name(const char *name, size_t length) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+// Returns the index slot holding `name`, or the empty slot where it belongs.
+static LabelNode **index_find(const CompilationUnit *CU, const char *name, size_t length) {
+	size_t mask = CU->label_index_size - 1;
+	size_t i = hash_name(name, length) & mask;
+	while (true) {
+		LabelNode **slot = &CU->label_index[i];
+		if (!*slot || ((*slot)->length == length && memcmp((*slot)->name, name, length) == 0)) {
+			return slot;
+		}
+		i = (i + 1) & mask;
+	}
+}
+static void index_grow(CompilationUnit *CU) {
+	LabelNode **old_index = CU->label_index;
+	size_t old_size = CU->label_index_size;
+	size_t size = old_size ? old_size * 2 : 64;
+	CU->label_index = diag_alloc(CU->diagnostics, size * sizeof(LabelNode*));
+	memset(CU->label_index, 0, size * sizeof(LabelNode*));
+	CU->label_index_size = size;
+	for (size_t i = 0; i < old_size; ++i) {
+		if (old_index[i]) {
+			*index_find(CU, old_index[i]->name, old_index[i]->length) = old_index[i];
+		}
+	}
+	diag_release(CU->diagnostics, old_index);
+}
+
 static void ensure_capacity(CompilationUnit *CU, size_t size) {
 	if (!CU->origin_set) {
-		fputs("ensure_capacity: origin not set\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fail(CU->diagnostics, FAILURE_SYNTAX, 0, "code before .org");
 	}
 	else if (size > 0xFFFF) {
-		fputs("ensure_capacity: size too large", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "ensure_capacity: size too large");
 	}
 
 	size_t buffer_remaining = CU->buffer_size - CU->buffer_offset;
+	if (CU->stream) {
+		// put_word() flushes the window as it fills up
+		buffer_remaining = 0x10000 - CU->origin - CU->buffer_offset;
+	}
 	if (buffer_remaining >= size) {
 		// enough capacity
 		return;
 	}
 
+	if (CU->shared) {
+		// a view's slice was sized up front; running past it is a bug
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "ensure_capacity: view overflow");
+	}
+
 	size_t addr_remaining = 0x10000 - CU->origin - CU->buffer_offset;
 	if (addr_remaining < size) {
-		fputs("address space overflow", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fail(
+			CU->diagnostics,
+			FAILURE_LIMITS,
+			0,
+			"address space overflow (%zu words needed, %zu available)",
+			size,
+			addr_remaining);
 	}
 
 	size_t new_size = CU->buffer_size * 2;
 	if (new_size < 32) {
 		new_size = 32;
 	}
-	if (new_size > addr_remaining) {
-		new_size = addr_remaining;
+	while (new_size - CU->buffer_offset < size) {
+		new_size *= 2;
+	}
+	if (new_size > CU->buffer_offset + addr_remaining) {
+		new_size = CU->buffer_offset + addr_remaining;
 	}
 
-	CU->buffer = realloc(CU->buffer, new_size);
+	CU->buffer = diag_realloc(CU->diagnostics, CU->buffer, new_size * sizeof(uint16_t));
+	if (CU->track_kinds) {
+		CU->kinds = diag_realloc(CU->diagnostics, CU->kinds, new_size);
+		memset(CU->kinds + CU->buffer_size, 0, new_size - CU->buffer_size);
+	}
+	CU->buffer_size = new_size;
+}
+static void stream_flush(CompilationUnit *CU);
+static void put_word(CompilationUnit *CU, uint16_t word) {
+	if (CU->stream && CU->buffer_offset - CU->stream_flushed == CU->buffer_size) {
+		stream_flush(CU);
+	}
+	CU->buffer[CU->buffer_offset++ - CU->stream_flushed] = word;
 }
 static void pad(CompilationUnit *CU, uint16_t word, size_t size) {
 	while (size-- > 0) {
-		CU->buffer[CU->buffer_offset++] = word;
+		put_word(CU, word);
 	}
 }
 
 // Emit
 void cu_align_to(CompilationUnit *CU, size_t alignment) {
 	if (alignment < 1) {
-		fputs("alignment must be >= 1\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "alignment must be >= 1");
 	}
 
 	size_t padding = CU->buffer_offset % alignment;
@@ -81,111 +150,231 @@ void cu_align_to(CompilationUnit *CU, size_t alignment) {
 
 void cu_emit_word(CompilationUnit *CU, uint16_t word) {
 	ensure_capacity(CU, 1);
-	CU->buffer[CU->buffer_offset++] = word;
+	put_word(CU, word);
 }
 void cu_emit_words(CompilationUnit *CU, const uint16_t *words, size_t size) {
 	if (size < 1) {
-		fputs("words size must be >= 1\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "words size must be >= 1");
 	}
 
 	ensure_capacity(CU, size);
 	while (size-- > 0) {
-		CU->buffer[CU->buffer_offset++] = *words++;
+		put_word(CU, *words++);
 	}
 }
 void cu_emit_bytes(CompilationUnit *CU, const uint8_t *bytes, size_t size) {
 	if (size < 1) {
-		fputs("words size must be >= 1\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "words size must be >= 1");
 	}
 
 	ensure_capacity(CU, size);
 	while (size-- > 0) {
-		CU->buffer[CU->buffer_offset++] = *bytes++;
+		put_word(CU, *bytes++);
+	}
+}
+void cu_emit_packed(CompilationUnit *CU, const uint8_t *bytes, size_t size) {
+	if (size < 1) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "words size must be >= 1");
+	}
+
+	ensure_capacity(CU, (size + 1) / 2);
+	for (; size >= 2; size -= 2, bytes += 2) {
+		put_word(CU, (uint16_t)(bytes[1] << 8 | bytes[0]));
+	}
+	if (size > 0) {
+		put_word(CU, bytes[0]);
 	}
 }
 void cu_emit_padding(CompilationUnit *CU, uint16_t word, size_t size) {
 	if (size < 1) {
-		fputs("padding size must be >= 1\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "padding size must be >= 1");
 	}
 
 	ensure_capacity(CU, size);
 	pad(CU, word, size);
 }
 
+void cu_mark(CompilationUnit *CU, WordKind kind) {
+	if (CU->kinds && CU->buffer_offset > 0) {
+		CU->kinds[CU->buffer_offset - 1] |= kind;
+	}
+}
+void cu_emit_image(CompilationUnit *CU, const uint8_t *bytes, size_t size) {
+	if (size < 1) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "image size must be >= 1");
+	}
+
+	ensure_capacity(CU, size);
+	while (size > 0) {
+		// a window at a time when streaming, else all at once
+		size_t count = size;
+		if (CU->stream) {
+			if (CU->buffer_offset - CU->stream_flushed == CU->buffer_size) {
+				stream_flush(CU);
+			}
+			size_t room = CU->buffer_size - (CU->buffer_offset - CU->stream_flushed);
+			count = room < size ? room : size;
+		}
+		uint16_t *words = &CU->buffer[CU->buffer_offset - CU->stream_flushed];
+		for (size_t i = 0; i < count; ++i) {
+			words[i] = (uint16_t)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+		}
+		CU->buffer_offset += count;
+		bytes += 2 * count;
+		size -= count;
+	}
+}
+
 // Linking
+static void stream_patch(CompilationUnit *CU, const LabelNode *label);
+static void stream_wait(CompilationUnit *CU, LateLinkingNode *node);
 void cu_register_label(CompilationUnit *CU, const char *name, size_t length, uint16_t target) {
 	LOGF_INFO("register label %.*s = x%04X", (int)length, name, target);
 	if (length < 1) {
-		fputs("cu_register_label: length < 1", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "cu_register_label: length < 1");
 	}
 
-	LabelNode *node = malloc(sizeof(LabelNode));
-	if (!node) {
-		fputs("ran out of memory!", stderr);
-		exit(FAILURE_MEMORY);
+	if (CU->shared) {
+		// registered up front in the shared unit
+		return;
 	}
-	node->name = malloc_string_copy(name, length);
-	node->length = length;
+	if (CU->label_capacity && CU->label_count == CU->label_capacity) {
+		diag_fail(
+			CU->diagnostics,
+			FAILURE_LIMITS,
+			0,
+			"label table full (limit is %zu labels%s)",
+			CU->label_capacity,
+			CU->stream ? "; raise the --stream bound" : "");
+	}
+	if (CU->label_count * 2 >= CU->label_index_size) {
+		index_grow(CU);
+	}
+	LabelNode **slot = index_find(CU, name, length);
+	if (*slot) {
+		diag_fail(
+			CU->diagnostics,
+			FAILURE_SYNTAX,
+			0,
+			"duplicate label %.*s (first defined at x%04X)",
+			(int)length,
+			name,
+			(*slot)->target);
+	}
+
+	// link the node before copying the name so cu_free() sees it either way
+	LabelNode *node = diag_alloc(CU->diagnostics, sizeof(LabelNode));
+	STATS_COUNT(SC_Labels, 1);
+	node->name = NULL;
+	node->length = 0;
 	node->target = target;
 	node->next = NULL;
+	LabelNode **tail = CU->label_tail ? CU->label_tail : &CU->first_label;
+	*tail = node;
+	CU->label_tail = &node->next;
+	node->name = malloc_string_copy(CU, name, length);
+	node->length = length;
+	*slot = node;
+	CU->label_count += 1;
 
-	LabelNode **cursor = &CU->first_label;
-	while (*cursor) {
-		// FIXME check for duplicates
-		cursor = &(*cursor)->next;
+	if (CU->stream) {
+		stream_patch(CU, node);
 	}
-	*cursor = node;
 }
 bool cu_label_get_target(CompilationUnit *CU, const char *name, size_t length, uint16_t *target) {
 	if (length < 1) {
-		fputs("cu_label_get_offset: length < 1", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "cu_label_get_target: length < 1");
 	}
 
-	LabelNode *cursor = CU->first_label;
-	while (cursor) {
-		if (cursor->length == length && memcmp(cursor->name, name, length) == 0) {
-			if (target) {
-				*target = cursor->target;
-			}
-			return true;
-		}
-		cursor = cursor->next;
+	const CompilationUnit *owner = CU->shared ? CU->shared : CU;
+	if (owner->label_index_size == 0) {
+		return false;
+	}
+	LabelNode *node = *index_find(owner, name, length);
+	if (!node || (CU->shared && node->target > cu_cursor_get(CU))) {
+		// a view must not see labels defined further down the source
+		return false;
+	}
+	if (target) {
+		*target = node->target;
+	}
+	return true;
+}
+void cu_each_label(const CompilationUnit *CU, void (*visit)(void *context, const char *name, size_t length, uint16_t target), void *context) {
+	for (const LabelNode *label = CU->first_label; label; label = label->next) {
+		visit(context, label->name, label->length, label->target);
 	}
-	return false;
 }
-void cu_late_link(CompilationUnit *CU, uint16_t address, LateLinkingType type, const char *name, size_t length) {
+void cu_late_link(CompilationUnit *CU, uint16_t address, LateLinkingType type, const char *name, size_t length, size_t column) {
 	LOGF_TRACE("late link x%04x to label %.*s (%u)", address, (int)length, name, type);
 
 	if (length < 1) {
-		fputs("cu_register_label: length < 1", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "cu_late_link: length < 1");
 	}
 
-	LateLinkingNode *node = malloc(sizeof(LateLinkingNode));
-	if (!node) {
-		fputs("ran out of memory!", stderr);
-		exit(FAILURE_MEMORY);
-	}
+	LateLinkingNode *node = diag_alloc(CU->diagnostics, sizeof(LateLinkingNode));
+	STATS_COUNT(SC_Fixups, 1);
 	node->type = type;
 	node->address = address;
-	node->name = malloc_string_copy(name, length);
-	node->length = length;
+	node->name = NULL;
+	node->length = 0;
+	node->line = CU->diagnostics->line;
+	node->column = column;
+	node->file = CU->diagnostics->include;
 	node->next = NULL;
+	node->next_waiting = NULL;
 
-	LateLinkingNode **cursor = &CU->first_late_linking;
-	while (*cursor) {
-		// FIXME check for duplicates
-		*cursor = (*cursor)->next;
+	LateLinkingNode **tail = CU->late_linking_tail ? CU->late_linking_tail : &CU->first_late_linking;
+	*tail = node;
+	node->link = tail;
+	CU->late_linking_tail = &node->next;
+	node->name = malloc_string_copy(CU, name, length);
+	node->length = length;
+
+	if (CU->stream) {
+		stream_wait(CU, node);
+	}
+}
+// Returns `word` linked to `target`; unchanged, with an error recorded, when
+// the target is out of reach.
+static uint16_t patch_word(CompilationUnit *CU, const LateLinkingNode *node, uint16_t word, uint16_t target) {
+	switch (node->type) {
+		case LLT_AbsoluteWord:
+			return target;
+		case LLT_OffsetPlusOneImm9: {
+			unsigned long offset = -1L - node->address + target;
+			unsigned long mask = ~0ul << 9;
+			unsigned long sign_mask = ~0ul << (9 - 1);
+			if (offset & sign_mask && ~offset & sign_mask) {
+				const char *include = CU->diagnostics->include;
+				CU->diagnostics->include = node->file;
+				diag_error_at(
+					CU->diagnostics,
+					FAILURE_LINKING,
+					node->line,
+					node->column,
+					"offset for label %.*s (%li) does not fit in %u bits",
+					(int)node->length,
+					node->name,
+					(long)offset,
+					9);
+				CU->diagnostics->include = include;
+				return word;
+			}
+			return (word & mask) | (offset & ~mask);
+		}
+		default:
+			diag_fatal(
+				CU->diagnostics,
+				FAILURE_INTERNAL,
+				"patch_word: unrecognized linking type (%u)",
+				node->type);
 	}
-	*cursor = node;
 }
 bool cu_resolve_linking(CompilationUnit *CU) {
 	LOGF_TRACE("resolve linking");
+	LOG_SPAN_BEGIN("link", NULL);
+	STATS_CLOCK(clock);
 
 	LateLinkingNode **cursor = &CU->first_late_linking;
 	while (true) {
@@ -195,23 +384,23 @@ bool cu_resolve_linking(CompilationUnit *CU) {
 		}
 		uint16_t address = current->address;
 		if (address < CU->origin) {
-			fprintf(
-				stderr,
+			diag_fatal(
+				CU->diagnostics,
+				FAILURE_INTERNAL,
 				"%s: patch address (x%04X) less than origin (x%04X)",
 				__func__,
 				address,
 				CU->origin);
-			exit(FAILURE_INTERNAL);
 		}
 		size_t index = address - CU->origin;
 		if (index >= CU->buffer_offset) {
-			fprintf(
-				stderr,
+			diag_fatal(
+				CU->diagnostics,
+				FAILURE_INTERNAL,
 				"%s: patch address (x%04X) greater than buffer position (x%04zX)",
 				__func__,
 				address,
 				CU->origin + CU->buffer_offset);
-			exit(FAILURE_INTERNAL);
 		}
 		uint16_t target;
 		if (cu_label_get_target(CU, current->name, current->length, &target)) {
@@ -223,32 +412,12 @@ bool cu_resolve_linking(CompilationUnit *CU) {
 				(int)current->length,
 				current->name,
 				current->type);
-			uint16_t word = CU->buffer[index];
-			switch (current->type) {
-				case LLT_AbsoluteWord:
-					word = target;
-					break;
-				case LLT_OffsetPlusOneImm9: {
-					unsigned long offset = -1L - address + target;
-					unsigned long mask = ~0ul << 9;
-					if (offset & mask && ~offset & mask) {
-						fprintf(stderr, "%s: offset (%zi) does not fit in %u bits\n", __func__, offset, 9);
-						exit(FAILURE_LINKING);
-					}
-					word &= mask;
-					word |= offset & ~mask;
-					break;
-				}
-				default:
-					fprintf(stderr, "cu_resolve_linking: unrecognized linking type (%u)", current->type);
-					exit(FAILURE_INTERNAL);
-			}
-			CU->buffer[index] = word;
+			CU->buffer[index] = patch_word(CU, current, CU->buffer[index], target);
 
 			// unlink and delete current
 			LateLinkingNode *next = current->next;
-			free(current->name);
-			free(current);
+			diag_release(CU->diagnostics, current->name);
+			diag_release(CU->diagnostics, current);
 			*cursor = next;
 		}
 		else {
@@ -263,6 +432,9 @@ bool cu_resolve_linking(CompilationUnit *CU) {
 		}
 	}
 
+	CU->late_linking_tail = cursor;
+	STATS_LAP(clock, SP_Link);
+	LOG_SPAN_END("link");
 	if (cursor == &CU->first_late_linking) {
 		LOGF_TRACE("linking resolved");
 		return true;
@@ -273,100 +445,177 @@ bool cu_resolve_linking(CompilationUnit *CU) {
 	}
 }
 
+void cu_mark_links(CompilationUnit *CU) {
+	if (!CU->kinds) {
+		return;
+	}
+	for (LabelNode *label = CU->first_label; label; label = label->next) {
+		size_t index = label->target - CU->origin;
+		if (index < CU->buffer_offset) {
+			CU->kinds[index] |= WK_Labeled;
+		}
+	}
+	for (LateLinkingNode *node = CU->first_late_linking; node; node = node->next) {
+		CU->kinds[node->address - CU->origin] |= WK_Linked;
+	}
+}
+void cu_compact(CompilationUnit *CU, const uint32_t *map) {
+	size_t size = CU->buffer_offset;
+	for (size_t i = 0; i < size; ++i) {
+		if (map[i + 1] > map[i]) {
+			CU->buffer[map[i]] = CU->buffer[i];
+			if (CU->kinds) {
+				CU->kinds[map[i]] = CU->kinds[i];
+			}
+		}
+	}
+	for (LabelNode *label = CU->first_label; label; label = label->next) {
+		size_t index = label->target - CU->origin;
+		if (index <= size) {
+			label->target = (uint16_t)(CU->origin + map[index]);
+		}
+	}
+	for (LateLinkingNode *node = CU->first_late_linking; node; node = node->next) {
+		node->address = (uint16_t)(CU->origin + map[node->address - CU->origin]);
+	}
+	CU->buffer_offset = map[size];
+}
+
 // Output
-static void write_byte(FILE *output, uint8_t byte) {
-	fputc(byte, output);
-}
-static void write_word(FILE *output, uint16_t word) {
-	char buffer[] = {
-		(char)(word >> 8),
-		(char)(word & 0xFF),
-	};
-	fwrite(buffer, 1, 2, output);
-}
-static void write_dword(FILE *output, uint32_t dword) {
-	char buffer[] = {
-		(char)(dword >> 24),
-		(char)(dword >> 16),
-		(char)(dword >> 8),
-		(char)(dword >> 0),
-	};
-	fwrite(buffer, 1, 4, output);
-}
-static void write_string(FILE *output, const char *string, size_t length) {
-	fwrite(string, 1, length, output);
-}
-
-void cu_produce_obj(CompilationUnit *CU, FILE *output) {
-	enum {
-		HEADER_SIZE = 32,
-	};
+static void write_byte(uint8_t **cursor, uint8_t byte) {
+	*(*cursor)++ = byte;
+}
+static void write_word(uint8_t **cursor, uint16_t word) {
+	write_byte(cursor, word >> 8);
+	write_byte(cursor, word & 0xFF);
+}
+static void write_dword(uint8_t **cursor, uint32_t dword) {
+	write_word(cursor, dword >> 16);
+	write_word(cursor, dword & 0xFFFF);
+}
+static void write_string(uint8_t **cursor, const char *string, size_t length) {
+	memcpy(*cursor, string, length);
+	*cursor += length;
+}
+
+static void table_sizes(const CompilationUnit *CU, uint32_t *label_size, uint32_t *linking_size) {
+	*label_size = 0;
+	*linking_size = 0;
+	for (LabelNode *label = CU->first_label; label; label = label->next) {
+		*label_size += 3 + label->length;
+	}
+	for (LateLinkingNode *lateLinking = CU->first_late_linking; lateLinking; lateLinking = lateLinking->next) {
+		*linking_size += 4 + lateLinking->length;
+	}
+}
+static void write_header(uint8_t **cursor, const CompilationUnit *CU, uint32_t label_size, uint32_t linking_size) {
+	uint32_t data_size = CU->buffer_offset * 2;
+	write_string(cursor, "LC3OBJ", 6);
+	write_byte(cursor, 0);
+	write_byte(cursor, 1);
+	write_word(cursor, CU->origin);
+	write_dword(cursor, HEADER_SIZE);
+	write_word(cursor, CU->buffer_offset);
+	write_dword(cursor, HEADER_SIZE + data_size);
+	write_dword(cursor, label_size);
+	write_dword(cursor, HEADER_SIZE + data_size + label_size);
+	write_dword(cursor, linking_size);
+}
 
+void cu_produce_obj(CompilationUnit *CU, uint8_t **object, size_t *object_size) {
 	LOGF_TRACE("produce obj");
 
-	cu_resolve_linking(CU);
+	LOG_SPAN_BEGIN("produce_obj", NULL);
+	STATS_CLOCK(clock);
 
 	uint32_t data_size = CU->buffer_offset * 2;
-	uint32_t label_size = 0;
-	uint32_t linking_size = 0;
-
-	// calculate sizes
-	LabelNode *label = CU->first_label;
-	while (label) {
-		label_size += 3 + label->length;
-		label = label->next;
-	}
-	LateLinkingNode *lateLinking = CU->first_late_linking;
-	while (lateLinking) {
-		linking_size += 4 + lateLinking->length;
-		lateLinking = lateLinking->next;
-	}
+	uint32_t label_size;
+	uint32_t linking_size;
+	table_sizes(CU, &label_size, &linking_size);
+	size_t size = HEADER_SIZE + data_size + label_size + linking_size;
+	uint8_t *buffer = diag_alloc(CU->diagnostics, size);
+	uint8_t *cursor = buffer;
 
 	// write header
 	LOGF_TRACE("write header");
-	write_string(output, "LC3OBJ", 6);
-	write_byte(output, 0);
-	write_byte(output, 1);
-	write_word(output, CU->origin);
-	write_dword(output, HEADER_SIZE);
-	write_word(output, CU->buffer_offset);
-	write_dword(output, HEADER_SIZE + data_size);
-	write_dword(output, label_size);
-	write_dword(output, HEADER_SIZE + data_size + label_size);
-	write_dword(output, linking_size);
+	write_header(&cursor, CU, label_size, linking_size);
 
 	// write data
 	LOGF_TRACE("write object code");
 	for (size_t i = 0; i < CU->buffer_offset; ++i) {
-		write_word(output, CU->buffer[i]);
+		write_word(&cursor, CU->buffer[i]);
 	}
 
 	// write label table
 	LOGF_TRACE("write label table");
-	label = CU->first_label;
+	LabelNode *label = CU->first_label;
 	while (label) {
-		write_word(output, label->target);
-		write_byte(output, label->length);
-		write_string(output, label->name, label->length);
-		label_size += 3 + label->length;
+		write_word(&cursor, label->target);
+		write_byte(&cursor, label->length);
+		write_string(&cursor, label->name, label->length);
 		label = label->next;
 	}
 
 	// write linking table
 	LOGF_TRACE("write linking table");
-	lateLinking = CU->first_late_linking;
+	LateLinkingNode *lateLinking = CU->first_late_linking;
 	while (lateLinking) {
-		write_word(output, lateLinking->address);
-		write_byte(output, lateLinking->type);
-		write_byte(output, lateLinking->length);
-		write_string(output, lateLinking->name, lateLinking->length);
-		linking_size += 4 + lateLinking->length;
+		write_word(&cursor, lateLinking->address);
+		write_byte(&cursor, lateLinking->type);
+		write_byte(&cursor, lateLinking->length);
+		write_string(&cursor, lateLinking->name, lateLinking->length);
 		lateLinking = lateLinking->next;
 	}
 
+	*object = buffer;
+	*object_size = size;
+	STATS_COUNT(SC_BytesWritten, size);
+	STATS_LAP(clock, SP_Output);
+	LOG_SPAN_END("produce_obj");
 	LOGF_TRACE("write complete");
 }
 
+void cu_free(CompilationUnit *CU) {
+	Diagnostics *D = CU->diagnostics;
+	LabelNode *label = CU->first_label;
+	while (label) {
+		LabelNode *next = label->next;
+		diag_release(D, label->name);
+		diag_release(D, label);
+		label = next;
+	}
+	LateLinkingNode *lateLinking = CU->first_late_linking;
+	while (lateLinking) {
+		LateLinkingNode *next = lateLinking->next;
+		diag_release(D, lateLinking->name);
+		diag_release(D, lateLinking);
+		lateLinking = next;
+	}
+	if (!CU->shared) {
+		diag_release(D, CU->buffer);
+	}
+	diag_release(D, CU->kinds);
+	CU->kinds = NULL;
+	CU->stream = NULL;
+	CU->stream_flushed = 0;
+	CU->stream_unflushed = NULL;
+	diag_release(D, CU->waiting_index);
+	CU->waiting_index = NULL;
+	CU->waiting_index_size = 0;
+	CU->waiting_count = 0;
+	diag_release(D, CU->label_index);
+	CU->first_label = NULL;
+	CU->label_tail = NULL;
+	CU->label_index = NULL;
+	CU->label_index_size = 0;
+	CU->label_count = 0;
+	CU->first_late_linking = NULL;
+	CU->late_linking_tail = NULL;
+	CU->buffer = NULL;
+	CU->buffer_size = 0;
+	CU->buffer_offset = 0;
+}
+
 // Config
 bool cu_origin_set(CompilationUnit *CU, uint16_t origin) {
 	if (CU->origin_set) {
@@ -380,10 +629,229 @@ bool cu_origin_set(CompilationUnit *CU, uint16_t origin) {
 }
 uint16_t cu_cursor_get(const CompilationUnit *CU) {
 	if (!CU->origin_set) {
-		fputs("cu_cursor_get: origin not set\n", stderr);
-		exit(FAILURE_INTERNAL);
+		diag_fail(CU->diagnostics, FAILURE_SYNTAX, 0, "code before .org");
 	}
 
 	return CU->origin + CU->buffer_offset;
 }
 
+// Views
+void cu_reserve(CompilationUnit *CU, size_t size) {
+	if (size > 0) {
+		ensure_capacity(CU, size);
+	}
+}
+void cu_view_init(CompilationUnit *view, const CompilationUnit *CU, Diagnostics *D, size_t offset, size_t size) {
+	memset(view, 0, sizeof(*view));
+	view->origin_set = true;
+	view->origin = CU->origin + offset;
+	view->buffer = CU->buffer + offset;
+	view->buffer_size = size;
+	view->shared = CU;
+	view->diagnostics = D;
+}
+void cu_view_merge(CompilationUnit *CU, CompilationUnit *view) {
+	if (view->buffer != CU->buffer + CU->buffer_offset) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "cu_view_merge: views merged out of order");
+	}
+	CU->buffer_offset += view->buffer_offset;
+	if (view->first_late_linking) {
+		LateLinkingNode **tail = CU->late_linking_tail ? CU->late_linking_tail : &CU->first_late_linking;
+		*tail = view->first_late_linking;
+		CU->late_linking_tail = view->late_linking_tail;
+	}
+	view->first_late_linking = NULL;
+	view->late_linking_tail = NULL;
+	view->buffer_offset = 0;
+}
+
+// Streaming
+static void stream_write(CompilationUnit *CU, const void *data, size_t size) {
+	if (fwrite(data, 1, size, CU->stream) != size) {
+		diag_fatal(CU->diagnostics, FAILURE_IO, "error while writing output");
+	}
+	STATS_COUNT(SC_BytesWritten, size);
+}
+static void stream_seek(CompilationUnit *CU, long offset, int origin) {
+	if (fseek(CU->stream, offset, origin) != 0) {
+		diag_fatal(CU->diagnostics, FAILURE_IO, "could not seek in output");
+	}
+}
+static void stream_flush(CompilationUnit *CU) {
+	size_t count = CU->buffer_offset - CU->stream_flushed;
+	// keep the words that forward references will need once they are out of reach
+	LateLinkingNode *node = CU->stream_unflushed;
+	for (; node && (size_t)(node->address - CU->origin) < CU->buffer_offset; node = node->next) {
+		node->word = CU->buffer[node->address - CU->origin - CU->stream_flushed];
+	}
+	CU->stream_unflushed = node;
+	uint8_t bytes[STREAM_WINDOW_WORDS * 2];
+	uint8_t *cursor = bytes;
+	for (size_t i = 0; i < count; ++i) {
+		write_word(&cursor, CU->buffer[i]);
+	}
+	stream_write(CU, bytes, count * 2);
+	CU->stream_flushed = CU->buffer_offset;
+}
+// Returns the slot of the references waiting for `name`, or the empty slot
+// where they belong. Each slot holds the newest of them.
+static LateLinkingNode **waiting_find(const CompilationUnit *CU, const char *name, size_t length) {
+	size_t mask = CU->waiting_index_size - 1;
+	size_t i = hash_name(name, length) & mask;
+	while (true) {
+		LateLinkingNode **slot = &CU->waiting_index[i];
+		if (!*slot || ((*slot)->length == length && memcmp((*slot)->name, name, length) == 0)) {
+			return slot;
+		}
+		i = (i + 1) & mask;
+	}
+}
+static void waiting_grow(CompilationUnit *CU) {
+	LateLinkingNode **old_index = CU->waiting_index;
+	size_t old_size = CU->waiting_index_size;
+	size_t size = old_size ? old_size * 2 : 64;
+	CU->waiting_index = diag_alloc(CU->diagnostics, size * sizeof(LateLinkingNode*));
+	memset(CU->waiting_index, 0, size * sizeof(LateLinkingNode*));
+	CU->waiting_index_size = size;
+	for (size_t i = 0; i < old_size; ++i) {
+		if (old_index[i]) {
+			*waiting_find(CU, old_index[i]->name, old_index[i]->length) = old_index[i];
+		}
+	}
+	diag_release(CU->diagnostics, old_index);
+}
+// Empties `slot`, moving the entries probed past it back so they are still
+// found.
+static void waiting_remove(CompilationUnit *CU, LateLinkingNode **slot) {
+	size_t mask = CU->waiting_index_size - 1;
+	size_t hole = (size_t)(slot - CU->waiting_index);
+	for (size_t i = (hole + 1) & mask; CU->waiting_index[i]; i = (i + 1) & mask) {
+		LateLinkingNode *node = CU->waiting_index[i];
+		size_t home = hash_name(node->name, node->length) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			CU->waiting_index[hole] = node;
+			hole = i;
+		}
+	}
+	CU->waiting_index[hole] = NULL;
+	CU->waiting_count -= 1;
+}
+// Files `node` under the name it refers to, so that defining the label
+// patches it without a search.
+static void stream_wait(CompilationUnit *CU, LateLinkingNode *node) {
+	LateLinkingNode **slot = CU->waiting_index_size ? waiting_find(CU, node->name, node->length) : NULL;
+	if (!slot || !*slot) {
+		if (CU->waiting_count * 2 >= CU->waiting_index_size) {
+			waiting_grow(CU);
+			slot = waiting_find(CU, node->name, node->length);
+		}
+		CU->waiting_count += 1;
+	}
+	node->next_waiting = *slot;
+	*slot = node;
+	if (!CU->stream_unflushed) {
+		CU->stream_unflushed = node;
+	}
+}
+static void stream_unlink(CompilationUnit *CU, LateLinkingNode *node) {
+	if (CU->stream_unflushed == node) {
+		CU->stream_unflushed = node->next;
+	}
+	*node->link = node->next;
+	if (node->next) {
+		node->next->link = node->link;
+	}
+	else {
+		CU->late_linking_tail = node->link;
+	}
+}
+static void stream_patch(CompilationUnit *CU, const LabelNode *label) {
+	LateLinkingNode **slot = CU->waiting_index_size ? waiting_find(CU, label->name, label->length) : NULL;
+	if (!slot || !*slot) {
+		return;
+	}
+	// filed newest first; patch them in source order, as linking does
+	LateLinkingNode *waiting = NULL;
+	for (LateLinkingNode *node = *slot, *next; node; node = next) {
+		next = node->next_waiting;
+		node->next_waiting = waiting;
+		waiting = node;
+	}
+	waiting_remove(CU, slot);
+	while (waiting) {
+		LateLinkingNode *current = waiting;
+		waiting = current->next_waiting;
+		size_t index = current->address - CU->origin;
+		if (index >= CU->stream_flushed) {
+			uint16_t *word = &CU->buffer[index - CU->stream_flushed];
+			*word = patch_word(CU, current, *word, label->target);
+		}
+		else {
+			uint8_t bytes[2];
+			uint8_t *bytes_cursor = bytes;
+			write_word(&bytes_cursor, patch_word(CU, current, current->word, label->target));
+			stream_seek(CU, CU->stream_start + HEADER_SIZE + (long)index * 2, SEEK_SET);
+			stream_write(CU, bytes, 2);
+			stream_seek(CU, 0, SEEK_END);
+		}
+		LOGF_TRACE("patched x%04X for %.*s", current->address, (int)label->length, label->name);
+		stream_unlink(CU, current);
+		diag_release(CU->diagnostics, current->name);
+		diag_release(CU->diagnostics, current);
+	}
+}
+
+void cu_stream_init(CompilationUnit *CU, FILE *output, size_t label_capacity) {
+	CU->stream = output;
+	CU->stream_start = ftell(output);
+	if (CU->stream_start < 0) {
+		diag_fatal(CU->diagnostics, FAILURE_IO, "could not seek in output");
+	}
+	CU->buffer = diag_alloc(CU->diagnostics, STREAM_WINDOW_WORDS * sizeof(uint16_t));
+	CU->buffer_size = STREAM_WINDOW_WORDS;
+	CU->label_capacity = label_capacity;
+	// a fixed table: sized once, never grown
+	while (CU->label_index_size < label_capacity * 2) {
+		index_grow(CU);
+	}
+	uint8_t header[HEADER_SIZE] = {0};
+	stream_write(CU, header, HEADER_SIZE);
+}
+void cu_stream_finish(CompilationUnit *CU) {
+	LOG_SPAN_BEGIN("produce_obj", NULL);
+	STATS_CLOCK(clock);
+	stream_flush(CU);
+
+	uint8_t bytes[4];
+	uint8_t *cursor;
+	for (LabelNode *label = CU->first_label; label; label = label->next) {
+		cursor = bytes;
+		write_word(&cursor, label->target);
+		write_byte(&cursor, label->length);
+		stream_write(CU, bytes, 3);
+		stream_write(CU, label->name, label->length);
+	}
+	for (LateLinkingNode *lateLinking = CU->first_late_linking; lateLinking; lateLinking = lateLinking->next) {
+		cursor = bytes;
+		write_word(&cursor, lateLinking->address);
+		write_byte(&cursor, lateLinking->type);
+		write_byte(&cursor, lateLinking->length);
+		stream_write(CU, bytes, 4);
+		stream_write(CU, lateLinking->name, lateLinking->length);
+	}
+
+	uint32_t label_size;
+	uint32_t linking_size;
+	table_sizes(CU, &label_size, &linking_size);
+	uint8_t header[HEADER_SIZE];
+	cursor = header;
+	write_header(&cursor, CU, label_size, linking_size);
+	stream_seek(CU, CU->stream_start, SEEK_SET);
+	stream_write(CU, header, HEADER_SIZE);
+	stream_seek(CU, 0, SEEK_END);
+	if (fflush(CU->stream) != 0) {
+		diag_fatal(CU->diagnostics, FAILURE_IO, "error while writing output");
+	}
+	STATS_LAP(clock, SP_Output);
+	LOG_SPAN_END("produce_obj");
+}
@@ -6,6 +6,15 @@ typedef enum LateLinkingType {
 	LLT_OffsetPlusOneImm9,
 } LateLinkingType;
 
+// What each word of the buffer holds, tracked for the optimizer; bits.
+typedef enum WordKind {
+	WK_Data = 0,
+	WK_Code = 1,        // emitted by an instruction
+	WK_Address = 2,     // a label's address
+	WK_Linked = 4,      // waits for a label from another unit
+	WK_Labeled = 8,     // some label points here
+} WordKind;
+
 typedef struct CompilationUnit {
 	bool origin_set;
 	uint16_t origin;
@@ -13,7 +22,31 @@ typedef struct CompilationUnit {
 	size_t buffer_size;
 	size_t buffer_offset;
 	struct LabelNode *first_label;
+	struct LabelNode **label_tail;          // next slot of the label list; NULL when empty
+	struct LabelNode **label_index;         // open addressing by name; size is a power of two
+	size_t label_index_size;
+	size_t label_count;
 	struct LateLinkingNode *first_late_linking;
+	struct LateLinkingNode **late_linking_tail;
+	const struct CompilationUnit *shared;   // set for views; labels come from here
+	size_t label_capacity;                  // fixed size of the label table; 0 grows as needed
+	FILE *stream;                           // streaming: buffer is a window onto this file
+	long stream_start;                      // file offset of the LC3OBJ header
+	size_t stream_flushed;                  // words written out ahead of buffer[0]
+	struct LateLinkingNode *stream_unflushed;   // first reference whose word is still in the window
+	struct LateLinkingNode **waiting_index; // streaming: references by name, open addressing
+	size_t waiting_index_size;
+	size_t waiting_count;                   // names in waiting_index
+	bool track_kinds;                       // keep `kinds` alongside the buffer
+	uint8_t *kinds;                         // WordKind bits of each buffer word, or NULL
+	// runs the lines of an .include in place of the directive; NULL where
+	// sources cannot be included
+	void (*include)(void *context, const char *path, size_t column);
+	// maps the file of an .incbin as .include finds it, recording it as a
+	// dependency; false once the error is reported. NULL maps the path as given
+	bool (*incbin)(void *context, const char *path, size_t column, MappedFile *file);
+	void *include_context;                  // passed to both hooks
+	Diagnostics *diagnostics;
 } CompilationUnit;
 
 // == Functions ==
@@ -25,18 +58,57 @@ void cu_align_to(CompilationUnit *CU, size_t alignment);
 void cu_emit_word(CompilationUnit *CU, uint16_t word);
 void cu_emit_words(CompilationUnit *CU, const uint16_t* words, size_t size);
 void cu_emit_bytes(CompilationUnit *CU, const uint8_t *bytes, size_t size);
+// Two bytes per word, the first in the low half (the PUTSP layout); an odd
+// last byte gets a high half of 0.
+void cu_emit_packed(CompilationUnit *CU, const uint8_t *bytes, size_t size);
 void cu_emit_padding(CompilationUnit *CU, uint16_t word, size_t count);
+// Adds `kind` to the last word emitted; ignored unless `track_kinds` is set.
+void cu_mark(CompilationUnit *CU, WordKind kind);
+// Copies `size` words stored as big-endian byte pairs, as in an LC3OBJ image.
+void cu_emit_image(CompilationUnit *CU, const uint8_t *bytes, size_t size);
 
 // Linking
 void cu_register_label(CompilationUnit *CU, const char *name, size_t length, uint16_t target);
 bool cu_label_get_target(CompilationUnit *CU, const char *name, size_t length, uint16_t *target);
-void cu_late_link(CompilationUnit *CU, uint16_t address, LateLinkingType type, const char *name, size_t length);
+// Calls `visit` for every label in the order they were registered.
+void cu_each_label(const CompilationUnit *CU, void (*visit)(void *context, const char *name, size_t length, uint16_t target), void *context);
+void cu_late_link(CompilationUnit *CU, uint16_t address, LateLinkingType type, const char *name, size_t length, size_t column);
 bool cu_resolve_linking(CompilationUnit *CU);
 
-// Output
-void cu_produce_obj(CompilationUnit *CU, FILE *output);
+// Rewriting a linked unit (`track_kinds` set). cu_mark_links() flags the words
+// that labels point at and those still waiting for a label. cu_compact()
+// keeps word i at index map[i] when map[i + 1] > map[i] and drops it
+// otherwise, moving labels and pending links with their words; map[size] is
+// the new size. Only the tables are updated; offsets and addresses held in
+// the words are the caller's business.
+void cu_mark_links(CompilationUnit *CU);
+void cu_compact(CompilationUnit *CU, const uint32_t *map);
+
+// Output; cu_resolve_linking() must have been called first. The LC3OBJ image
+// is allocated from the diagnostics allocator and owned by the caller.
+void cu_produce_obj(CompilationUnit *CU, uint8_t **object, size_t *object_size);
+void cu_free(CompilationUnit *CU);
 
 // Config
 bool cu_origin_set(CompilationUnit *CU, uint16_t origin);
 uint16_t cu_cursor_get(const CompilationUnit *CU);
 
+// Views encode a slice of the object in parallel with other views. A view
+// writes into `size` words at word `offset` of `CU`'s buffer reserved with
+// cu_reserve(), sees
+// only the labels of `CU` at or before its cursor (as a single pass would)
+// and does not register labels of its own; cu_view_merge() hands its output
+// and unresolved links back to `CU`, in source order.
+void cu_reserve(CompilationUnit *CU, size_t size);
+void cu_view_init(CompilationUnit *view, const CompilationUnit *CU, Diagnostics *D, size_t offset, size_t size);
+void cu_view_merge(CompilationUnit *CU, CompilationUnit *view);
+
+// Streaming writes the object to `output` through a window of a few hundred
+// bytes, holding at most `label_capacity` labels. A forward reference is
+// patched in the file as soon as its label is registered, so
+// cu_resolve_linking() is not used; cu_stream_finish() writes the tables of
+// labels and of the references that are still unresolved and completes the
+// header. `output` must be seekable.
+void cu_stream_init(CompilationUnit *CU, FILE *output, size_t label_capacity);
+void cu_stream_finish(CompilationUnit *CU);
+
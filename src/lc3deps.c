@@ -0,0 +1,68 @@
+#include "lc3std.h"
+#include "lc3deps.h"
+
+char *deps_rename(const char *path, const char *from, const char *to) {
+	size_t length = strlen(path);
+	size_t from_length = strlen(from);
+	if (length > from_length && stricmp(&path[length - from_length], from) == 0) {
+		length -= from_length;
+	}
+	size_t to_length = strlen(to);
+	char *renamed = malloc(length + to_length + 1);
+	if (!renamed) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	memcpy(renamed, path, length);
+	memcpy(&renamed[length], to, to_length + 1);
+	return renamed;
+}
+
+static void print_make_path(const char *path, FILE *output) {
+	for (; *path; ++path) {
+		if (*path == ' ' || *path == '#') {
+			fputc('\\', output);
+		}
+		else if (*path == '$') {
+			fputc('$', output);
+		}
+		fputc(*path, output);
+	}
+}
+void deps_print(const char *target, const char *source, char *const *includes, size_t count, FILE *output) {
+	print_make_path(target, output);
+	fputs(": ", output);
+	print_make_path(source, output);
+	for (size_t i = 0; i < count; ++i) {
+		fputs(" \\\n  ", output);
+		print_make_path(includes[i], output);
+	}
+	fputc('\n', output);
+	for (size_t i = 0; i < count; ++i) {
+		fputc('\n', output);
+		print_make_path(includes[i], output);
+		fputs(":\n", output);
+	}
+}
+
+int deps_write(const char *target, const char *source, char *const *includes, size_t count) {
+	char *renamed = target ? NULL : deps_rename(source, ".asm", ".obj");
+	const char *name = target ? target : renamed;
+	char *path = deps_rename(name, ".obj", ".d");
+	int status = EXIT_SUCCESS;
+	FILE *output = fopen(path, "w");
+	if (!output) {
+		fprintf(stderr, "could not open file \"%s\"\n", path);
+		status = FAILURE_IO;
+	}
+	else {
+		deps_print(name, source, includes, count, output);
+		if (fclose(output) != 0) {
+			fprintf(stderr, "error while writing file \"%s\"\n", path);
+			status = FAILURE_IO;
+		}
+	}
+	free(path);
+	free(renamed);
+	return status;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Make rules for -MD, shared by lc3asm and lc3asmc.
+
+// Returns a malloc()ed copy of `path` with `from` at its end (in any case)
+// replaced by `to`, or with `to` appended when it does not end in `from`.
+char *deps_rename(const char *path, const char *from, const char *to);
+
+// Prints a make rule saying that `target` depends on `source` and on each of
+// `includes`, followed by an empty rule for each of them so that make does
+// not stop when one is deleted.
+void deps_print(const char *target, const char *source, char *const *includes, size_t count, FILE *output);
+
+// Writes the rule to the target name ending in ".d" instead of ".obj"; a NULL
+// `target` is `source` ending in ".obj" instead of ".asm". Returns 0 or the
+// exit status after reporting the error.
+int deps_write(const char *target, const char *source, char *const *includes, size_t count);
@@ -0,0 +1,235 @@
+#include "lc3asm.h"
+
+enum {
+	MESSAGE_MAX_SIZE = 256,
+};
+
+static void *default_allocate(void *context, size_t size) {
+	(void)context;
+	return malloc(size);
+}
+static void *default_reallocate(void *context, void *pointer, size_t size) {
+	(void)context;
+	return realloc(pointer, size);
+}
+static void default_release(void *context, void *pointer) {
+	(void)context;
+	free(pointer);
+}
+static const Lc3Allocator DefaultAllocator = { default_allocate, default_reallocate, default_release, NULL };
+
+// Prefix of every block handed out under a budget, so release knows its size.
+typedef union BudgetHeader {
+	size_t size;
+	max_align_t alignment;
+} BudgetHeader;
+
+// Returns NULL when out of memory; the callers decide whether that is fatal.
+static char *copy_string(Diagnostics *D, const char *string) {
+	size_t length = strlen(string);
+	char *copy = D->allocator.allocate(D->allocator.context, length + 1);
+	if (!copy) {
+		return NULL;
+	}
+	STATS_COUNT(SC_Mallocs, 1);
+	memcpy(copy, string, length + 1);
+	return copy;
+}
+
+static bool diag_vrecord(Diagnostics *D, int code, size_t line, size_t column, const char *format, va_list args) {
+	if (D->count == D->capacity) {
+		size_t capacity = D->capacity ? D->capacity * 2 : 16;
+		Diagnostic *items = D->allocator.reallocate(D->allocator.context, D->items, capacity * sizeof(Diagnostic));
+		if (!items) {
+			return false;
+		}
+		STATS_COUNT(SC_Mallocs, 1);
+		D->items = items;
+		D->capacity = capacity;
+	}
+
+	char message[MESSAGE_MAX_SIZE];
+	if (vsnprintf(message, MESSAGE_MAX_SIZE, format, args) < 0) {
+		strncpy(message, "<failed to format message>", MESSAGE_MAX_SIZE);
+	}
+	LOGF_DEBUG("diagnostic %zu:%zu: %s", line, column, message);
+
+	char *copy = copy_string(D, message);
+	char *source = NULL;
+	char *file = NULL;
+	if (!copy
+		|| (line == D->line && D->source && !(source = copy_string(D, D->source)))
+		|| (D->include && !(file = copy_string(D, D->include)))) {
+		if (copy) {
+			D->allocator.release(D->allocator.context, copy);
+		}
+		if (source) {
+			D->allocator.release(D->allocator.context, source);
+		}
+		return false;
+	}
+	Diagnostic *item = &D->items[D->count++];
+	item->code = code;
+	item->line = line;
+	item->column = column;
+	item->message = copy;
+	item->source = source;
+	item->file = file;
+	return true;
+}
+static void diag_record(Diagnostics *D, int code, size_t line, size_t column, const char *format, va_list args) {
+	if (!diag_vrecord(D, code, line, column, format, args)) {
+		diag_fatal(D, FAILURE_MEMORY, "ran out of memory");
+	}
+}
+
+void diag_init(Diagnostics *D, const char *file, size_t limit, const Lc3Allocator *allocator) {
+	memset(D, 0, sizeof(*D));
+	D->file = file;
+	D->limit = limit;
+	D->allocator = allocator ? *allocator : DefaultAllocator;
+}
+void diag_free(Diagnostics *D) {
+	for (size_t i = 0; i < D->count; ++i) {
+		diag_release(D, D->items[i].message);
+		diag_release(D, D->items[i].source);
+		diag_release(D, D->items[i].file);
+	}
+	diag_release(D, D->items);
+	D->items = NULL;
+	D->count = 0;
+	D->capacity = 0;
+}
+
+void diag_error(Diagnostics *D, int code, size_t column, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	diag_record(D, code, D->line, column, format, args);
+	va_end(args);
+}
+void diag_error_at(Diagnostics *D, int code, size_t line, size_t column, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	diag_record(D, code, line, column, format, args);
+	va_end(args);
+}
+_Noreturn void diag_fail(Diagnostics *D, int code, size_t column, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	diag_record(D, code, D->line, column, format, args);
+	va_end(args);
+
+	longjmp(D->recover ? *D->recover : *D->abort, 1);
+}
+_Noreturn void diag_fatal(Diagnostics *D, int code, const char *format, ...) {
+	// best effort: the message is dropped if there is no memory left for it
+	va_list args;
+	va_start(args, format);
+	diag_vrecord(D, code, D->line, 0, format, args);
+	va_end(args);
+
+	D->fatal = code;
+	longjmp(*D->abort, 1);
+}
+
+bool diag_limit_reached(const Diagnostics *D) {
+	return D->limit > 0 && D->count >= D->limit;
+}
+int diag_exit_code(const Diagnostics *D) {
+	if (D->fatal) {
+		return D->fatal;
+	}
+	return D->count > 0 ? D->items[0].code : EXIT_SUCCESS;
+}
+
+void diag_print(const char *file, const Diagnostic *items, size_t count, bool limit_reached, FILE *output) {
+	log_flush();
+	for (size_t i = 0; i < count; ++i) {
+		const Diagnostic *item = &items[i];
+		const char *name = item->file ? item->file : file;
+		if (item->line == 0) {
+			fprintf(output, "%s: error: %s\n", name, item->message);
+		}
+		else if (item->column == 0) {
+			fprintf(output, "%s:%zu: error: %s\n", name, item->line, item->message);
+		}
+		else {
+			fprintf(output, "%s:%zu:%zu: error: %s\n", name, item->line, item->column, item->message);
+		}
+		if (item->source) {
+			fprintf(output, "%s\n", item->source);
+			if (item->column > 0) {
+				// keep tabs so the caret lines up with the source
+				for (size_t c = 0; c + 1 < item->column && item->source[c]; ++c) {
+					fputc(item->source[c] == '\t' ? '\t' : ' ', output);
+				}
+				fputs("^\n", output);
+			}
+		}
+	}
+	if (limit_reached) {
+		fprintf(output, "%s: stopping after %zu errors (see --error-limit)\n", file, count);
+	}
+	fflush(output);
+}
+
+static void budget_charge(Diagnostics *D, size_t released, size_t size) {
+	size_t used = D->used - released;
+	if (size > D->budget - used) {
+		diag_fatal(D, FAILURE_LIMITS, "working memory limit of %zu bytes exceeded", D->budget);
+	}
+	D->used = used + size;
+	if (D->used > D->peak) {
+		D->peak = D->used;
+	}
+}
+
+void diag_set_budget(Diagnostics *D, size_t budget) {
+	D->budget = budget;
+	D->used = 0;
+	D->peak = 0;
+}
+void *diag_alloc(Diagnostics *D, size_t size) {
+	if (D->budget) {
+		return diag_realloc(D, NULL, size);
+	}
+	void *pointer = D->allocator.allocate(D->allocator.context, size);
+	if (!pointer) {
+		diag_fatal(D, FAILURE_MEMORY, "ran out of memory");
+	}
+	STATS_COUNT(SC_Mallocs, 1);
+	return pointer;
+}
+void *diag_realloc(Diagnostics *D, void *pointer, size_t size) {
+	BudgetHeader *header = NULL;
+	if (D->budget) {
+		header = pointer ? (BudgetHeader*)pointer - 1 : NULL;
+		budget_charge(D, header ? sizeof(BudgetHeader) + header->size : 0, sizeof(BudgetHeader) + size);
+		pointer = header;
+		size += sizeof(BudgetHeader);
+	}
+	void *result = pointer
+		? D->allocator.reallocate(D->allocator.context, pointer, size)
+		: D->allocator.allocate(D->allocator.context, size);
+	if (!result) {
+		diag_fatal(D, FAILURE_MEMORY, "ran out of memory");
+	}
+	STATS_COUNT(SC_Mallocs, 1);
+	if (D->budget) {
+		header = result;
+		header->size = size - sizeof(BudgetHeader);
+		result = header + 1;
+	}
+	return result;
+}
+void diag_release(Diagnostics *D, void *pointer) {
+	if (!pointer) {
+		return;
+	}
+	if (D->budget) {
+		BudgetHeader *header = (BudgetHeader*)pointer - 1;
+		D->used -= sizeof(BudgetHeader) + header->size;
+		pointer = header;
+	}
+	D->allocator.release(D->allocator.context, pointer);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// == Types ==
+typedef Lc3Diagnostic Diagnostic;
+
+typedef struct Diagnostics {
+	const char *file;
+	Diagnostic *items;
+	size_t count;
+	size_t capacity;
+	size_t limit;       // stop assembling after this many errors; 0 is unlimited
+	size_t line;        // location of the line being processed, 0 outside lines
+	const char *source;
+	const char *include;    // file the line comes from when it was included, else NULL
+	jmp_buf *recover;   // where diag_fail abandons the current line
+	jmp_buf *abort;     // where diag_fatal abandons the whole assembly; must be set
+	int fatal;          // code passed to diag_fatal, 0 if none
+	Lc3Allocator allocator;
+	size_t budget;      // bytes diag_alloc may hand out at once; 0 is unlimited and untracked
+	size_t used;
+	size_t peak;
+} Diagnostics;
+
+// == Functions ==
+void diag_init(Diagnostics *D, const char *file, size_t limit, const Lc3Allocator *allocator);
+void diag_free(Diagnostics *D);
+
+// Records an error at `column` (1-based, 0 if unknown) of the current line.
+void diag_error(Diagnostics *D, int code, size_t column, const char *format, ...);
+void diag_error_at(Diagnostics *D, int code, size_t line, size_t column, const char *format, ...);
+// Records an error and abandons the current line through D->recover, or the
+// whole assembly when outside a line.
+_Noreturn void diag_fail(Diagnostics *D, int code, size_t column, const char *format, ...);
+// Records an error and abandons the whole assembly through D->abort.
+_Noreturn void diag_fatal(Diagnostics *D, int code, const char *format, ...);
+
+bool diag_limit_reached(const Diagnostics *D);
+int diag_exit_code(const Diagnostics *D);
+void diag_print(const char *file, const Diagnostic *items, size_t count, bool limit_reached, FILE *output);
+
+// Memory from D->allocator; running out is fatal. With a budget, going over it
+// is fatal too; the budget covers everything but the diagnostics themselves
+// and must be set before the first diag_alloc().
+void diag_set_budget(Diagnostics *D, size_t budget);
+void *diag_alloc(Diagnostics *D, size_t size);
+void *diag_realloc(Diagnostics *D, void *pointer, size_t size);
+void diag_release(Diagnostics *D, void *pointer);
@@ -96,10 +96,6 @@ char* next_lexeme(char **rest) {
 		*rest = cursor + 1;
 		return start;
 	}
-	else if (c == '\'') {
-		fputs("\nnot implemented: lexeme char\n", stderr);
-		exit(FAILURE_NOTIMPLEMENTED);
-	}
 	else {
 		*rest = start;
 		return NULL;
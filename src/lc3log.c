@@ -1,12 +1,48 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include "lc3std.h"
 #include "lc3log.h"
 
+#if !defined(LC3_LOG_ASYNC) && !defined(__STDC_NO_THREADS__)
+#define LC3_LOG_ASYNC 1
+#endif
+#if LC3_LOG_ASYNC
+#include <threads.h>
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL
+#endif
+
+enum {
+	LOG_MESSAGE_MAX = 256,
+	LOG_RING_RECORDS = 256,
+	LOG_BATCH_SIZE = 64 * 1024,
+	SPAN_BUFFER_SIZE = 1024 * 1024,
+	SPAN_NO_DETAIL = 0xFFFF,
+};
+
+typedef enum SpanRecordType {
+	SRT_String = 1,
+	SRT_Begin,
+	SRT_End,
+} SpanRecordType;
+
 typedef struct VerbosityNameEntry {
 	const char *name;
 	VerbosityLevel level;
 } VerbosityNameEntry;
 
-static VerbosityLevel g_verbosity;
+// A message captured by log_printf; timestamp and prefix are formatted by
+// the writer so that producers only pay for the user message.
+typedef struct LogRecord {
+	VerbosityLevel level;
+	const char *file;
+	int line;
+	time_t time;
+	char message[LOG_MESSAGE_MAX];
+} LogRecord;
+
+VerbosityLevel g_log_verbosity = VL_Warn;
 static FILE *g_target;
 
 static VerbosityNameEntry g_verbosity_names[] = {
@@ -31,6 +67,11 @@ void log_init(void) {
 		level = VL_Warn;
 	}
 	log_config(level, target);
+
+	char *trace = getenv("LC3_TRACE");
+	if (trace && trace[0] && !log_trace_open(trace)) {
+		LOGF_WARN("could not open trace file \"%s\"", trace);
+	}
 }
 
 bool log_tryparse_verbosity(const char *string, VerbosityLevel *level) {
@@ -101,7 +142,7 @@ bool log_enabled(VerbosityLevel level) {
 		fprintf(stderr, "bad verbosity level %u", level);
 	}
 
-	return g_verbosity <= level;
+	return level <= LC3_LOG_LEVEL && level <= g_log_verbosity;
 }
 
 void log_config(VerbosityLevel level, FILE *target) {
@@ -114,106 +155,206 @@ void log_config(VerbosityLevel level, FILE *target) {
 		exit(FAILURE_INTERNAL);
 	}
 
-	g_verbosity = level;
+	log_flush();
+	g_log_verbosity = level;
 	g_target = target;
 }
 
-static void log_vprintf(VerbosityLevel level, const char *file, int line, const char *format, va_list args) {
-	enum { LINE_MAX_SIZE = 128 };
-
-	if (level <= VL_Quiet || level >= VL_CountPlusOne) {
-		if (g_verbosity >= VL_Fatal) {
-			fprintf(stderr, "bad verbosity level %u\n", level);
-		}
-		exit(FAILURE_INTERNAL);
-	}
-	if (level > g_verbosity) {
-		return;
-	}
-
-	char buffer[LINE_MAX_SIZE];
-
-	// add timestamp
-	time_t time_raw;
-	struct tm *time_info;
-	time(&time_raw);
-	time_info = localtime(&time_raw);
-	size_t written = strftime(buffer, LINE_MAX_SIZE, "%FT%T", time_info);
-	if (written == 0) {
-		strncpy(buffer, "???\\?-?\\?-??T??:??:??", LINE_MAX_SIZE);
-		written = 19;
-		if (written > LINE_MAX_SIZE) {
-			written = LINE_MAX_SIZE;
-		}
-	}
-
-	// add label, file, and line
-	const char *label;
+static const char *level_label(VerbosityLevel level) {
 	switch (level) {
 		case VL_Fatal:
-			label = "FATAL";
-			break;
+			return "FATAL";
 		case VL_Error:
-			label = "ERROR";
-			break;
+			return "ERROR";
 		case VL_Warn:
-			label = "WARN";
-			break;
+			return "WARN";
 		case VL_Info:
-			label = "INFO";
-			break;
+			return "INFO";
 		case VL_Debug:
-			label = "DEBUG";
-			break;
+			return "DEBUG";
 		case VL_Trace:
-			label = "TRACE";
-			break;
-		case VL_Quiet:
-			log_vprintf(VL_Fatal, file, line, format, args);
-			exit(FAILURE_INTERNAL);
+			return "TRACE";
 		default:
 			fprintf(stderr, "invalid verbosity level %u\n", level);
 			exit(FAILURE_INTERNAL);
 	}
+}
+
+// Appends the formatted line for `record` to `buffer`; returns bytes written.
+// The timestamp is only re-rendered when the second changes.
+static size_t format_record(const LogRecord *record, char *buffer, size_t capacity) {
+	enum { TIMESTAMP_SIZE = 32 };
+	static time_t cached_time = -1;
+	static char cached_timestamp[TIMESTAMP_SIZE];
+
+	if (record->time != cached_time) {
+		struct tm *time_info = localtime(&record->time);
+		if (!time_info || strftime(cached_timestamp, TIMESTAMP_SIZE, "%FT%T", time_info) == 0) {
+			strncpy(cached_timestamp, "???\?-?\?-??T??:??:??", TIMESTAMP_SIZE);
+		}
+		cached_time = record->time;
+	}
+
 	int result = snprintf(
-		buffer + written,
-		LINE_MAX_SIZE - written,
-		" %-5s %s:%u ",
-		label,
-		file,
-		line);
-	if (result >= 0) {
-		written += result;
+		buffer,
+		capacity,
+		"%s %-5s %s:%u %s\n",
+		cached_timestamp,
+		level_label(record->level),
+		record->file,
+		record->line,
+		record->message);
+	if (result < 0) {
+		return 0;
 	}
-	else {
-		strncpy(buffer + written, " ????? ?:? ", LINE_MAX_SIZE - written);
-		written += 11;
+	else if ((size_t)result >= capacity) {
+		// truncated; keep the line terminated
+		buffer[capacity - 2] = '\n';
+		return capacity - 1;
 	}
-	if (written > LINE_MAX_SIZE) {
-		written = LINE_MAX_SIZE;
+	return (size_t)result;
+}
+
+#if LC3_LOG_ASYNC
+// Producers append records under `lock`; the single writer thread reads the
+// slots between `tail` and a snapshot of `head` without holding the lock and
+// writes them out in batches.
+static struct {
+	mtx_t lock;
+	cnd_t not_empty;
+	cnd_t not_full;
+	cnd_t drained;
+	size_t head;
+	size_t tail;
+	bool shutdown;
+	bool running;
+	thrd_t writer;
+	LogRecord records[LOG_RING_RECORDS];
+} g_ring;
+static once_flag g_ring_once = ONCE_FLAG_INIT;
+
+static int log_writer(void *arg) {
+	(void)arg;
+	static char batch[LOG_BATCH_SIZE];
+
+	mtx_lock(&g_ring.lock);
+	while (true) {
+		while (g_ring.tail == g_ring.head && !g_ring.shutdown) {
+			cnd_wait(&g_ring.not_empty, &g_ring.lock);
+		}
+		if (g_ring.tail == g_ring.head) {
+			break;
+		}
+		size_t head = g_ring.head;
+		size_t tail = g_ring.tail;
+		FILE *target = g_target;
+		mtx_unlock(&g_ring.lock);
+
+		size_t used = 0;
+		for (; tail != head; ++tail) {
+			if (LOG_BATCH_SIZE - used < LOG_MESSAGE_MAX * 2) {
+				fwrite(batch, 1, used, target);
+				used = 0;
+			}
+			used += format_record(&g_ring.records[tail % LOG_RING_RECORDS], batch + used, LOG_BATCH_SIZE - used);
+		}
+		fwrite(batch, 1, used, target);
+		fflush(target);
+
+		mtx_lock(&g_ring.lock);
+		g_ring.tail = tail;
+		cnd_broadcast(&g_ring.not_full);
+		if (g_ring.tail == g_ring.head) {
+			cnd_broadcast(&g_ring.drained);
+		}
 	}
+	mtx_unlock(&g_ring.lock);
+	return 0;
+}
+
+static void log_shutdown(void) {
+	mtx_lock(&g_ring.lock);
+	g_ring.shutdown = true;
+	cnd_signal(&g_ring.not_empty);
+	mtx_unlock(&g_ring.lock);
+	thrd_join(g_ring.writer, NULL);
+}
 
-	// add user message
-	result = vsnprintf(buffer + written, LINE_MAX_SIZE - written, format, args);
-	if (result >= 0) {
-		written += result;
+static void log_start(void) {
+	if (mtx_init(&g_ring.lock, mtx_plain) != thrd_success
+		|| cnd_init(&g_ring.not_empty) != thrd_success
+		|| cnd_init(&g_ring.not_full) != thrd_success
+		|| cnd_init(&g_ring.drained) != thrd_success
+		|| thrd_create(&g_ring.writer, log_writer, NULL) != thrd_success) {
+		// stay synchronous
+		return;
 	}
-	else {
-		strncpy(buffer + written, "<failed to format message>", LINE_MAX_SIZE - written);
-		written += 26;
+	g_ring.running = true;
+	// assemble() leaves through exit(); drain the ring from there
+	atexit(log_shutdown);
+}
+
+static void log_enqueue(const LogRecord *record) {
+	mtx_lock(&g_ring.lock);
+	while (g_ring.head - g_ring.tail == LOG_RING_RECORDS) {
+		cnd_wait(&g_ring.not_full, &g_ring.lock);
+	}
+	g_ring.records[g_ring.head % LOG_RING_RECORDS] = *record;
+	g_ring.head += 1;
+	cnd_signal(&g_ring.not_empty);
+	mtx_unlock(&g_ring.lock);
+}
+
+void log_flush(void) {
+	if (!g_ring.running) {
+		return;
+	}
+	mtx_lock(&g_ring.lock);
+	while (g_ring.tail != g_ring.head) {
+		cnd_wait(&g_ring.drained, &g_ring.lock);
+	}
+	mtx_unlock(&g_ring.lock);
+}
+#else
+void log_flush(void) {
+}
+#endif
+
+static void log_vprintf(VerbosityLevel level, const char *file, int line, const char *format, va_list args) {
+	if (level <= VL_Quiet || level >= VL_CountPlusOne) {
+		if (g_log_verbosity >= VL_Fatal) {
+			fprintf(stderr, "bad verbosity level %u\n", level);
+		}
+		exit(FAILURE_INTERNAL);
 	}
-	if (written > LINE_MAX_SIZE) {
-		written = LINE_MAX_SIZE;
+	if (level > g_log_verbosity) {
+		return;
 	}
 
-	// add newline
-	if (written + 1 < LINE_MAX_SIZE) {
-		buffer[written + 0] = '\n';
-		buffer[written + 1] = '\0';
+	LogRecord record;
+	record.level = level;
+	record.file = file;
+	record.line = line;
+	time(&record.time);
+	if (vsnprintf(record.message, LOG_MESSAGE_MAX, format, args) < 0) {
+		strncpy(record.message, "<failed to format message>", LOG_MESSAGE_MAX);
 	}
 
-	fputs(buffer, stderr);
-	fflush(stderr);
+#if LC3_LOG_ASYNC
+	call_once(&g_ring_once, log_start);
+	if (g_ring.running) {
+		log_enqueue(&record);
+		if (level <= VL_Error) {
+			// keep failures ordered with the direct stderr output around them
+			log_flush();
+		}
+		return;
+	}
+#endif
+	char buffer[LOG_MESSAGE_MAX * 2];
+	size_t written = format_record(&record, buffer, sizeof(buffer));
+	fwrite(buffer, 1, written, g_target);
+	fflush(g_target);
 }
 void log_printf(VerbosityLevel level, const char *file, int line, const char *format, ...) {
 	va_list args;
@@ -222,3 +363,215 @@ void log_printf(VerbosityLevel level, const char *file, int line, const char *fo
 	va_end(args);
 }
 
+// Span events
+bool g_log_spans;
+static struct {
+	FILE *file;
+	char **copies;
+	size_t count;
+	size_t capacity;
+	uint16_t *index;        // open addressing of copies by content; SPAN_NO_DETAIL is empty
+	size_t index_size;      // a power of two, more than twice count
+	uint32_t threads;
+	bool initialized;
+#if LC3_LOG_ASYNC
+	mtx_t lock;
+#endif
+} g_spans;
+static THREAD_LOCAL uint32_t t_span_thread;
+
+static void span_lock(void) {
+#if LC3_LOG_ASYNC
+	mtx_lock(&g_spans.lock);
+#endif
+}
+static void span_unlock(void) {
+#if LC3_LOG_ASYNC
+	mtx_unlock(&g_spans.lock);
+#endif
+}
+
+static size_t put_be(uint8_t *buffer, uint64_t value, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		buffer[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+	}
+	return size;
+}
+
+// FNV-1a of the first UINT8_MAX characters of `string`, where copies are cut;
+// `length` gets how many that is.
+static size_t span_hash(const char *string, size_t *length) {
+	uint32_t hash = 2166136261u;
+	size_t i = 0;
+	for (; i < UINT8_MAX && string[i]; ++i) {
+		hash ^= (uint8_t)string[i];
+		hash *= 16777619u;
+	}
+	*length = i;
+	return hash;
+}
+// Returns the index slot holding the copy of the first `length` characters of
+// `string`, or the empty slot where it belongs.
+static uint16_t *span_slot(const char *string, size_t length, size_t hash) {
+	size_t mask = g_spans.index_size - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		uint16_t *slot = &g_spans.index[i];
+		if (*slot == SPAN_NO_DETAIL) {
+			return slot;
+		}
+		const char *copy = g_spans.copies[*slot];
+		if (strncmp(copy, string, length) == 0 && copy[length] == 0) {
+			return slot;
+		}
+	}
+}
+static void span_grow_index(void) {
+	size_t size = g_spans.index_size ? g_spans.index_size * 2 : 64;
+	uint16_t *index = malloc(size * sizeof(uint16_t));
+	if (!index) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	memset(index, 0xFF, size * sizeof(uint16_t));
+	free(g_spans.index);
+	g_spans.index = index;
+	g_spans.index_size = size;
+	for (size_t i = 0; i < g_spans.count; ++i) {
+		size_t length;
+		size_t hash = span_hash(g_spans.copies[i], &length);
+		*span_slot(g_spans.copies[i], length, hash) = (uint16_t)i;
+	}
+}
+
+// Returns the id for `string`, writing a string record the first time it is
+// seen, or SPAN_NO_DETAIL once the table is full. Strings are matched by
+// content, so callers may free them afterwards. Called with the span lock held.
+static uint16_t span_intern(const char *string) {
+	if (g_spans.count * 2 >= g_spans.index_size) {
+		span_grow_index();
+	}
+	size_t length;
+	size_t hash = span_hash(string, &length);
+	uint16_t *slot = span_slot(string, length, hash);
+	if (*slot != SPAN_NO_DETAIL) {
+		return *slot;
+	}
+	if (g_spans.count >= SPAN_NO_DETAIL) {
+		return SPAN_NO_DETAIL;
+	}
+	if (g_spans.count == g_spans.capacity) {
+		size_t capacity = g_spans.capacity ? g_spans.capacity * 2 : 32;
+		char **copies = realloc(g_spans.copies, capacity * sizeof(char*));
+		if (!copies) {
+			fputs("ran out of memory!\n", stderr);
+			exit(FAILURE_MEMORY);
+		}
+		g_spans.copies = copies;
+		g_spans.capacity = capacity;
+	}
+
+	char *copy = malloc(length + 1);
+	if (!copy) {
+		fputs("ran out of memory!\n", stderr);
+		exit(FAILURE_MEMORY);
+	}
+	memcpy(copy, string, length);
+	copy[length] = 0;
+
+	uint16_t id = (uint16_t)g_spans.count++;
+	g_spans.copies[id] = copy;
+	*slot = id;
+
+	uint8_t header[4];
+	size_t size = 0;
+	size += put_be(header + size, SRT_String, 1);
+	size += put_be(header + size, id, 2);
+	size += put_be(header + size, length, 1);
+	fwrite(header, 1, size, g_spans.file);
+	fwrite(copy, 1, length, g_spans.file);
+	return id;
+}
+
+static void span_write(SpanRecordType type, const char *name, const char *detail) {
+	span_lock();
+	if (!g_spans.file) {
+		span_unlock();
+		return;
+	}
+	// taken under the lock, so the records of all threads are in time order
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t timestamp = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+	if (!t_span_thread) {
+		t_span_thread = ++g_spans.threads;
+	}
+	uint16_t id = span_intern(name);
+	if (id == SPAN_NO_DETAIL) {
+		// table is full; drop spans with names not seen before
+		span_unlock();
+		return;
+	}
+	uint8_t record[17];
+	size_t size = 0;
+	size += put_be(record + size, type, 1);
+	size += put_be(record + size, id, 2);
+	if (type == SRT_Begin) {
+		size += put_be(record + size, detail ? span_intern(detail) : SPAN_NO_DETAIL, 2);
+	}
+	size += put_be(record + size, t_span_thread, 4);
+	size += put_be(record + size, timestamp, 8);
+	fwrite(record, 1, size, g_spans.file);
+	span_unlock();
+}
+
+static void log_trace_close(void) {
+	span_lock();
+	g_log_spans = false;
+	if (g_spans.file) {
+		fclose(g_spans.file);
+		g_spans.file = NULL;
+	}
+	span_unlock();
+}
+
+// Opens `path` as the span sink, replacing any sink opened earlier.
+bool log_trace_open(const char *path) {
+	if (!g_spans.initialized) {
+#if LC3_LOG_ASYNC
+		if (mtx_init(&g_spans.lock, mtx_plain) != thrd_success) {
+			return false;
+		}
+#endif
+		g_spans.initialized = true;
+		// assemble() can leave through exit(); close the file from there
+		atexit(log_trace_close);
+	}
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+	setvbuf(file, NULL, _IOFBF, SPAN_BUFFER_SIZE);
+	fwrite("LC3TRC\0\1", 1, 8, file);
+
+	span_lock();
+	if (g_spans.file) {
+		fclose(g_spans.file);
+	}
+	for (size_t i = 0; i < g_spans.count; ++i) {
+		free(g_spans.copies[i]);
+	}
+	g_spans.count = 0;
+	if (g_spans.index) {
+		memset(g_spans.index, 0xFF, g_spans.index_size * sizeof(uint16_t));
+	}
+	g_spans.file = file;
+	g_log_spans = true;
+	span_unlock();
+	return true;
+}
+void log_span_begin(const char *name, const char *detail) {
+	span_write(SRT_Begin, name, detail);
+}
+void log_span_end(const char *name) {
+	span_write(SRT_End, name, NULL);
+}
@@ -11,14 +11,25 @@ typedef enum VerbosityLevel {
 	VL_CountPlusOne,
 } VerbosityLevel;
 
+// Most verbose level compiled in; LOGF calls above it generate no code.
+#ifndef LC3_LOG_LEVEL
+#define LC3_LOG_LEVEL VL_Trace
+#endif
+
+// Current runtime level; read inline by LOGF, set through log_config().
+extern VerbosityLevel g_log_verbosity;
+
 void log_init(void);
 bool log_tryparse_verbosity(const char *string, VerbosityLevel *level);
 void log_config(VerbosityLevel level, FILE *target);
 void log_printf(VerbosityLevel level, const char *file, int line, const char *format, ...);
+void log_flush(void);
 bool log_enabled(VerbosityLevel level);
 
 #define LOGF(level, ...) do {\
-	log_printf((level), __FILE__, __LINE__, __VA_ARGS__);\
+	if ((level) <= LC3_LOG_LEVEL && (level) <= g_log_verbosity) {\
+		log_printf((level), __FILE__, __LINE__, __VA_ARGS__);\
+	}\
 } while (false)
 
 #define LOGF_FATAL(...) LOGF(VL_Fatal, __VA_ARGS__)
@@ -28,8 +39,37 @@ bool log_enabled(VerbosityLevel level);
 #define LOGF_DEBUG(...) LOGF(VL_Debug, __VA_ARGS__)
 #define LOGF_TRACE(...) LOGF(VL_Trace, __VA_ARGS__)
 
+// Span events for profiling tools, written to the file named by LC3_TRACE or
+// --trace; see trace.txt for the format and out/lc3trace for conversion.
+#ifndef LC3_LOG_SPANS
+#define LC3_LOG_SPANS 1
+#endif
+
+extern bool g_log_spans;
+
+bool log_trace_open(const char *path);
+// `name` and `detail` are copied; once 65535 distinct strings are recorded,
+// new details are dropped and spans with new names are skipped.
+void log_span_begin(const char *name, const char *detail);
+void log_span_end(const char *name);
+
+#if LC3_LOG_SPANS
+#define LOG_SPAN_BEGIN(name, detail) do {\
+	if (g_log_spans) {\
+		log_span_begin((name), (detail));\
+	}\
+} while (false)
+#define LOG_SPAN_END(name) do {\
+	if (g_log_spans) {\
+		log_span_end((name));\
+	}\
+} while (false)
+#else
+#define LOG_SPAN_BEGIN(name, detail) ((void)0)
+#define LOG_SPAN_END(name) ((void)0)
+#endif
+
 #define FAILF(code, ...) do {\
 	LOGF_FATAL(__VA_ARGS__);\
 	exit((code));\
 } while (false)
-
@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lc3std.h"
+#include "lc3map.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static FileId id_of(const struct stat *info) {
+	return (FileId){
+		(uint64_t)info->st_dev,
+		(uint64_t)info->st_ino,
+		(uint64_t)info->st_size,
+		(int64_t)info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec,
+	};
+}
+
+bool map_file(const char *path, MappedFile *file) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	bool ok = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+	*file = (MappedFile){ NULL, 0, ok ? id_of(&info) : (FileId){ 0, 0, 0, 0 } };
+	if (ok && info.st_size > 0) {
+		void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ok = false;
+		}
+		else {
+			posix_madvise(data, info.st_size, POSIX_MADV_SEQUENTIAL);
+			file->data = data;
+			file->size = info.st_size;
+		}
+	}
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+	return ok;
+}
+void unmap_file(MappedFile *file) {
+	if (file->data) {
+		munmap((void*)file->data, file->size);
+	}
+	file->data = NULL;
+	file->size = 0;
+}
+bool file_id(const char *path, FileId *id) {
+	struct stat info;
+	if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+		return false;
+	}
+	*id = id_of(&info);
+	return true;
+}
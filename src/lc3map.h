@@ -0,0 +1,25 @@
+#pragma once
+
+// Which file a path names, and which version of it: two ids with the same
+// device and inode are the same file, and it is unchanged while its size and
+// modification time stay the same.
+typedef struct FileId {
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t modified;   // nanoseconds since the epoch
+} FileId;
+
+// Read-only view of a whole file, mapped into memory where possible. An empty
+// file maps to `data` NULL and `size` 0.
+typedef struct MappedFile {
+	const uint8_t *data;
+	size_t size;
+	FileId id;          // of the file as it was mapped
+} MappedFile;
+
+// Returns false if `path` cannot be opened or mapped.
+bool map_file(const char *path, MappedFile *file);
+void unmap_file(MappedFile *file);
+// Returns false if `path` does not name a regular file.
+bool file_id(const char *path, FileId *id);
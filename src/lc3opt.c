@@ -0,0 +1,258 @@
+#include "lc3asm.h"
+
+enum {
+	OP_BR = 0x0,
+	OP_ADD = 0x1,
+	OP_LD = 0x2,
+	OP_ST = 0x3,
+	OP_JSR = 0x4,
+	OP_AND = 0x5,
+	OP_LDR = 0x6,
+	OP_NOT = 0x9,
+	OP_LDI = 0xA,
+	OP_STI = 0xB,
+	OP_LEA = 0xE,
+	MAX_THREAD_HOPS = 16,
+};
+
+// Optimizer-only bits next to the WordKind ones.
+enum {
+	OK_Entered = 16,    // a branch, jump or address leads here
+	OK_Pinned = 32,     // read or written as data
+	OK_Removed = 64,
+};
+
+static unsigned opcode(uint16_t word) {
+	return word >> 12;
+}
+// Bits of the PC-relative offset, or 0 for instructions without one.
+static unsigned offset_bits(uint16_t word) {
+	switch (opcode(word)) {
+		case OP_BR:
+		case OP_LD:
+		case OP_LDI:
+		case OP_LEA:
+		case OP_ST:
+		case OP_STI:
+			return 9;
+		case OP_JSR:
+			return word & 0x0800 ? 11 : 0;
+		default:
+			return 0;
+	}
+}
+static long offset_get(uint16_t word, unsigned bits) {
+	long offset = word & ~(~0u << bits);
+	return offset & 1l << (bits - 1) ? offset - (1l << bits) : offset;
+}
+static bool offset_fits(long offset, unsigned bits) {
+	return offset >= -(1l << (bits - 1)) && offset < 1l << (bits - 1);
+}
+static uint16_t offset_set(uint16_t word, unsigned bits, long offset) {
+	uint16_t mask = (uint16_t)(~0u << bits);
+	return (uint16_t)((word & mask) | (offset & ~mask));
+}
+
+// PC-relative code whose target is known: not waiting for another unit.
+static bool is_relative(const CompilationUnit *CU, size_t i) {
+	return (CU->kinds[i] & (WK_Code | WK_Linked)) == WK_Code && offset_bits(CU->buffer[i]) > 0;
+}
+// Index of the word a PC-relative instruction refers to; may be outside the unit.
+static long target_of(const CompilationUnit *CU, size_t i) {
+	uint16_t word = CU->buffer[i];
+	return (long)i + 1 + offset_get(word, offset_bits(word));
+}
+static bool in_unit(const CompilationUnit *CU, long index) {
+	return index >= 0 && (size_t)index < CU->buffer_offset;
+}
+static bool is_jump(const CompilationUnit *CU, size_t i) {
+	uint16_t word = CU->buffer[i];
+	return (CU->kinds[i] & (WK_Code | WK_Linked)) == WK_Code && opcode(word) == OP_BR && (word >> 9 & 7) == 7;
+}
+static bool sets_condition(uint16_t word) {
+	switch (opcode(word)) {
+		case OP_ADD:
+		case OP_AND:
+		case OP_NOT:
+		case OP_LD:
+		case OP_LDI:
+		case OP_LDR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void find_entries(CompilationUnit *CU) {
+	uint8_t *kinds = CU->kinds;
+	for (size_t i = 0; i < CU->buffer_offset; ++i) {
+		if (kinds[i] & WK_Address && !(kinds[i] & WK_Linked)) {
+			long index = (long)CU->buffer[i] - CU->origin;
+			if (in_unit(CU, index)) {
+				kinds[index] |= OK_Entered;
+			}
+		}
+		if (!is_relative(CU, i)) {
+			continue;
+		}
+		long target = target_of(CU, i);
+		if (!in_unit(CU, target)) {
+			continue;
+		}
+		switch (opcode(CU->buffer[i])) {
+			case OP_LD:
+			case OP_LDI:
+			case OP_ST:
+			case OP_STI:
+				kinds[target] |= OK_Pinned;
+				break;
+			default:
+				kinds[target] |= OK_Entered;
+				break;
+		}
+	}
+}
+
+// Sends branches that land on an unconditional branch to its final target.
+static size_t thread_branches(CompilationUnit *CU) {
+	size_t rewritten = 0;
+	for (size_t i = 0; i < CU->buffer_offset; ++i) {
+		uint16_t word = CU->buffer[i];
+		if (!is_relative(CU, i) || opcode(word) != OP_BR || (word >> 9 & 7) == 0) {
+			continue;
+		}
+		long target = target_of(CU, i);
+		long final = target;
+		for (int hops = 0; hops < MAX_THREAD_HOPS && in_unit(CU, final) && is_jump(CU, final); ++hops) {
+			long next = target_of(CU, final);
+			if (next == final) {
+				break;
+			}
+			final = next;
+		}
+		long offset = final - (long)i - 1;
+		if (final != target && offset_fits(offset, 9)) {
+			LOGF_DEBUG("peephole: branch at x%04zX to x%04lX", CU->origin + i, CU->origin + final);
+			CU->buffer[i] = offset_set(word, 9, offset);
+			rewritten += 1;
+		}
+	}
+	return rewritten;
+}
+
+static bool removable(const CompilationUnit *CU, size_t i) {
+	const uint8_t *kinds = CU->kinds;
+	uint16_t word = CU->buffer[i];
+	if ((kinds[i] & (WK_Code | WK_Linked | OK_Pinned)) != WK_Code) {
+		return false;
+	}
+	switch (opcode(word)) {
+		case OP_BR:
+			return (word >> 9 & 7) == 0 || offset_get(word, 9) == 0;
+		case OP_ADD: {
+			unsigned reg = word >> 9 & 7;
+			bool nop = word == (0x1020 | reg << 9 | reg << 6);
+			// the codes it sets must be overwritten before anything can test them
+			return nop
+				&& i + 1 < CU->buffer_offset
+				&& (kinds[i + 1] & (WK_Code | OK_Removed)) == WK_Code
+				&& sets_condition(CU->buffer[i + 1]);
+		}
+		case OP_LD:
+		case OP_LEA:
+			// the same register loaded from the same place, with nothing in between
+			return i > 0
+				&& !(kinds[i] & (WK_Labeled | OK_Entered))
+				&& is_relative(CU, i - 1)
+				&& opcode(CU->buffer[i - 1]) == opcode(word)
+				&& (CU->buffer[i - 1] >> 9 & 7) == (word >> 9 & 7)
+				&& target_of(CU, i - 1) == target_of(CU, i);
+		default:
+			return false;
+	}
+}
+
+// One round of removal; returns the number of words removed. Removing a word
+// can leave another removable, such as a branch that now targets the next
+// word, so the caller repeats rounds until one removes nothing.
+static size_t remove_words(CompilationUnit *CU, uint32_t *map) {
+	size_t size = CU->buffer_offset;
+	uint8_t *kinds = CU->kinds;
+	size_t removed = 0;
+	find_entries(CU);
+
+	// backwards, so that whether the next word stays is already known
+	for (size_t i = size; i-- > 0;) {
+		if (removable(CU, i)) {
+			kinds[i] |= OK_Removed;
+			removed += 1;
+		}
+	}
+	map[0] = 0;
+	for (size_t i = 0; i < size; ++i) {
+		map[i + 1] = map[i] + !(kinds[i] & OK_Removed);
+	}
+
+	// code moves closer to what lies beyond the unit, which may then be out of reach
+	bool fits = true;
+	for (size_t i = 0; i < size && fits && removed > 0; ++i) {
+		if (!(kinds[i] & OK_Removed) && is_relative(CU, i)) {
+			long target = target_of(CU, i);
+			long moved = target >= 0 && (size_t)target <= size ? (long)map[target] : target;
+			fits = offset_fits(moved - map[i] - 1, offset_bits(CU->buffer[i]));
+		}
+	}
+	if (!fits) {
+		LOGF_INFO("peephole: an offset would be out of reach; nothing more removed");
+		removed = 0;
+	}
+	if (removed > 0) {
+		for (size_t i = 0; i < size; ++i) {
+			if (kinds[i] & OK_Removed) {
+				continue;
+			}
+			if (is_relative(CU, i)) {
+				long target = target_of(CU, i);
+				long moved = target >= 0 && (size_t)target <= size ? (long)map[target] : target;
+				CU->buffer[i] = offset_set(CU->buffer[i], offset_bits(CU->buffer[i]), moved - map[i] - 1);
+			}
+			else if ((kinds[i] & (WK_Address | WK_Linked)) == WK_Address) {
+				long index = (long)CU->buffer[i] - CU->origin;
+				if (index >= 0 && (size_t)index <= size) {
+					CU->buffer[i] = (uint16_t)(CU->origin + map[index]);
+				}
+			}
+		}
+		cu_compact(CU, map);
+	}
+	for (size_t i = 0; i < CU->buffer_offset; ++i) {
+		kinds[i] &= ~(OK_Entered | OK_Pinned | OK_Removed);
+	}
+	return removed;
+}
+
+void opt_peephole(CompilationUnit *CU, OptReport *report) {
+	LOG_SPAN_BEGIN("optimize", NULL);
+	STATS_CLOCK(clock);
+	*report = (OptReport){ 0, 0 };
+	size_t size = CU->buffer_offset;
+	if (!CU->kinds || size == 0) {
+		LOG_SPAN_END("optimize");
+		return;
+	}
+	// the unit only shrinks, so the first map is large enough for every round
+	uint32_t *map = diag_alloc(CU->diagnostics, (size + 1) * sizeof(uint32_t));
+	cu_mark_links(CU);
+	report->rewritten = thread_branches(CU);
+
+	size_t removed;
+	do {
+		removed = remove_words(CU, map);
+		report->removed += removed;
+	} while (removed > 0);
+	diag_release(CU->diagnostics, map);
+	STATS_COUNT(SC_WordsSaved, report->removed);
+	STATS_LAP(clock, SP_Optimize);
+	LOG_SPAN_END("optimize");
+	LOGF_INFO("peephole: removed %zu words, rewrote %zu branches", report->removed, report->rewritten);
+}
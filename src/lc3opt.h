@@ -0,0 +1,19 @@
+#pragma once
+
+typedef struct OptReport {
+	size_t removed;     // words deleted from the object
+	size_t rewritten;   // branches sent straight to their final target
+} OptReport;
+
+// Peephole pass over a linked unit assembled with `track_kinds` set; call it
+// after cu_resolve_linking() and before the object is produced. Only words
+// emitted by instructions are touched, and every label, offset, address and
+// pending link is moved along with the code:
+// - a branch to a `BRnzp` goes straight to where that branch leads;
+// - branches to the next word and branches that are never taken go;
+// - `ADD Rx, Rx, #0` goes when the next instruction sets the condition codes
+//   itself;
+// - an `LD` or `LEA` that repeats the one right before it goes, unless
+//   something jumps to it.
+// Nothing is deleted if that would put some offset out of reach.
+void opt_peephole(CompilationUnit *CU, OptReport *report);
@@ -0,0 +1,357 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lc3std.h"
+#include "lc3log.h"
+#include "liblc3asm.h"
+#include "lc3wire.h"
+#include "lc3server.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <threads.h>
+#include <unistd.h>
+
+// Each connection is served on its own thread. Requests allocate from an
+// arena that is reset, not freed, between requests and returned to a pool
+// when the connection closes, so a busy server stops calling malloc once its
+// arenas have grown to the largest input.
+
+enum {
+	ARENA_CHUNK_SIZE = 1 << 20,
+	ARENA_ALIGNMENT = 16,
+	LISTEN_BACKLOG = 64,
+};
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGNMENT) uint8_t data[];
+} ArenaChunk;
+
+typedef struct Arena {
+	ArenaChunk *first;
+	ArenaChunk *current;
+	struct Arena *next_free;
+} Arena;
+
+// every block is preceded by its size so that reallocate can copy it
+typedef struct ArenaBlock {
+	_Alignas(ARENA_ALIGNMENT) size_t size;
+} ArenaBlock;
+
+static volatile sig_atomic_t g_stop;
+static mtx_t g_pool_lock;
+static Arena *g_pool;
+
+static void *arena_allocate(void *context, size_t size) {
+	Arena *arena = context;
+	size_t needed = sizeof(ArenaBlock) + (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+	ArenaChunk *chunk = arena->current;
+	while (chunk && chunk->size - chunk->used < needed) {
+		chunk = chunk->next;
+	}
+	if (!chunk) {
+		size_t chunk_size = needed > ARENA_CHUNK_SIZE ? needed : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		// keep chunks in one list so that reset finds them all again
+		ArenaChunk **cursor = &arena->first;
+		while (*cursor) {
+			cursor = &(*cursor)->next;
+		}
+		chunk->next = NULL;
+		*cursor = chunk;
+	}
+	arena->current = chunk;
+	ArenaBlock *block = (ArenaBlock*)&chunk->data[chunk->used];
+	block->size = size;
+	chunk->used += needed;
+	return block + 1;
+}
+static void *arena_reallocate(void *context, void *pointer, size_t size) {
+	if (!pointer) {
+		return arena_allocate(context, size);
+	}
+	ArenaBlock *block = (ArenaBlock*)pointer - 1;
+	if (block->size >= size) {
+		return pointer;
+	}
+	void *grown = arena_allocate(context, size);
+	if (grown) {
+		memcpy(grown, pointer, block->size);
+	}
+	return grown;
+}
+static void arena_release(void *context, void *pointer) {
+	// everything goes at once in arena_reset
+	(void)context;
+	(void)pointer;
+}
+static void arena_reset(Arena *arena) {
+	for (ArenaChunk *chunk = arena->first; chunk; chunk = chunk->next) {
+		chunk->used = 0;
+	}
+	arena->current = arena->first;
+}
+
+static Arena *pool_take(void) {
+	mtx_lock(&g_pool_lock);
+	Arena *arena = g_pool;
+	if (arena) {
+		g_pool = arena->next_free;
+	}
+	mtx_unlock(&g_pool_lock);
+	if (!arena) {
+		arena = calloc(1, sizeof(Arena));
+	}
+	return arena;
+}
+static void pool_give(Arena *arena) {
+	arena_reset(arena);
+	mtx_lock(&g_pool_lock);
+	arena->next_free = g_pool;
+	g_pool = arena;
+	mtx_unlock(&g_pool_lock);
+}
+
+typedef struct Response {
+	int status;
+	const char *text;
+	size_t text_size;
+	const uint8_t *object;
+	size_t object_size;
+	const char *includes;   // the included paths, each followed by a NUL
+	size_t includes_size;
+} Response;
+
+static bool respond(int fd, const Response *response) {
+	uint8_t header[WIRE_RESPONSE_SIZE] = { 'L', 'C', '3', 'P', WIRE_VERSION };
+	wire_put_u32(&header[8], response->status);
+	wire_put_u32(&header[12], response->text_size);
+	wire_put_u32(&header[16], response->object_size);
+	wire_put_u32(&header[20], response->includes_size);
+	return wire_write(fd, header, WIRE_RESPONSE_SIZE)
+		&& wire_write(fd, response->text, response->text_size)
+		&& wire_write(fd, response->object, response->object_size)
+		&& wire_write(fd, response->includes, response->includes_size);
+}
+static bool respond_text(int fd, int status, const char *format, ...) {
+	char text[WIRE_MAX_NAME + 64];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if (length < 0) {
+		length = 0;
+	}
+	else if ((size_t)length >= sizeof(text)) {
+		length = sizeof(text) - 1;
+	}
+	Response response = { status, text, length, NULL, 0, NULL, 0 };
+	return respond(fd, &response);
+}
+
+static char *read_path(Arena *arena, const char *path, size_t *length) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	struct stat info;
+	char *buffer = NULL;
+	if (fstat(fileno(file), &info) == 0 && (size_t)info.st_size <= WIRE_MAX_PAYLOAD) {
+		buffer = arena_allocate(arena, info.st_size + 1);
+	}
+	if (buffer) {
+		*length = fread(buffer, 1, info.st_size, file);
+		if (ferror(file)) {
+			buffer = NULL;
+		}
+	}
+	fclose(file);
+	return buffer;
+}
+
+// Serves one request; false once the connection should be closed.
+static bool serve_request(int fd, Arena *arena) {
+	uint8_t header[WIRE_REQUEST_SIZE];
+	if (!wire_read(fd, header, WIRE_REQUEST_SIZE)) {
+		return false;
+	}
+	if (memcmp(header, "LC3Q", 4) != 0 || header[4] != WIRE_VERSION) {
+		LOGF_WARN("server: bad request header");
+		return false;
+	}
+	WireRequestKind kind = header[5];
+	uint16_t flags = wire_get_u16(&header[6]);
+	uint32_t error_limit = wire_get_u32(&header[8]);
+	uint32_t name_length = wire_get_u32(&header[12]);
+	uint32_t payload_length = wire_get_u32(&header[16]);
+	if ((kind != WRK_Path && kind != WRK_Source)
+		|| (flags & ~WRF_Known)
+		|| name_length > WIRE_MAX_NAME
+		|| payload_length > WIRE_MAX_PAYLOAD) {
+		LOGF_WARN(
+			"server: bad request (kind %u, flags x%04X, name %u bytes, payload %u bytes)",
+			kind,
+			flags,
+			name_length,
+			payload_length);
+		return false;
+	}
+
+	char *name = arena_allocate(arena, name_length + 1);
+	char *payload = arena_allocate(arena, payload_length + 1);
+	if (!name || !payload) {
+		return respond_text(fd, FAILURE_MEMORY, "ran out of memory!\n");
+	}
+	if (!wire_read(fd, name, name_length) || !wire_read(fd, payload, payload_length)) {
+		return false;
+	}
+	name[name_length] = 0;
+	payload[payload_length] = 0;
+
+	const char *source = payload;
+	size_t length = payload_length;
+	if (kind == WRK_Path) {
+		source = read_path(arena, payload, &length);
+		if (!source) {
+			return respond_text(fd, FAILURE_ARGS, "could not open file \"%s\"\n", name);
+		}
+	}
+
+	Lc3Allocator allocator = { arena_allocate, arena_reallocate, arena_release, arena };
+	// requests already run in parallel, and the arena is not thread-safe
+	Lc3AsmOptions options = {
+		name,
+		error_limit,
+		&allocator,
+		1,
+		flags & WRF_Optimize,
+		NULL,
+		kind == WRK_Path ? payload : NULL,
+	};
+	Lc3AsmResult result;
+	int status = lc3asm_assemble(source, length, &options, &result);
+	LOGF_INFO("server: %s (status %i, %zu bytes)", name, status, result.object_size);
+
+	char *text = NULL;
+	size_t text_size = 0;
+	if (result.diagnostic_count > 0) {
+		FILE *stream = open_memstream(&text, &text_size);
+		if (stream) {
+			lc3asm_print_diagnostics(&result, stream);
+			fclose(stream);
+		}
+	}
+	Response response = { status, text, text_size, result.object, result.object_size, NULL, 0 };
+	if (flags & WRF_Dependencies) {
+		for (size_t i = 0; i < result.include_count; ++i) {
+			response.includes_size += strlen(result.includes[i]) + 1;
+		}
+		char *includes = arena_allocate(arena, response.includes_size);
+		if (!includes) {
+			free(text);
+			lc3asm_result_free(&result);
+			return respond_text(fd, FAILURE_MEMORY, "ran out of memory!\n");
+		}
+		char *cursor = includes;
+		for (size_t i = 0; i < result.include_count; ++i) {
+			size_t length = strlen(result.includes[i]) + 1;
+			memcpy(cursor, result.includes[i], length);
+			cursor += length;
+		}
+		response.includes = includes;
+	}
+	bool ok = respond(fd, &response);
+	free(text);
+	lc3asm_result_free(&result);
+	return ok;
+}
+
+static int serve_connection(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	Arena *arena = pool_take();
+	if (arena) {
+		while (serve_request(fd, arena)) {
+			arena_reset(arena);
+		}
+		pool_give(arena);
+	}
+	close(fd);
+	return 0;
+}
+
+static void on_signal(int signal) {
+	(void)signal;
+	g_stop = 1;
+}
+
+int server_run(const char *path) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "socket path too long \"%s\"\n", path);
+		return FAILURE_ARGS;
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		perror("socket");
+		return FAILURE_IO;
+	}
+	struct stat info;
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		// left behind by a server that did not shut down cleanly
+		unlink(path);
+	}
+	if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, LISTEN_BACKLOG) < 0) {
+		fprintf(stderr, "could not listen on \"%s\": %s\n", path, strerror(errno));
+		close(listener);
+		return FAILURE_IO;
+	}
+	if (mtx_init(&g_pool_lock, mtx_plain) != thrd_success) {
+		fputs("could not create pool lock\n", stderr);
+		close(listener);
+		return FAILURE_INTERNAL;
+	}
+
+	// no SA_RESTART: accept() must return so the loop sees g_stop
+	struct sigaction action = { .sa_handler = on_signal };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	LOGF_INFO("server: listening on %s", path);
+	int status = EXIT_SUCCESS;
+	while (!g_stop) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			status = FAILURE_IO;
+			break;
+		}
+		thrd_t thread;
+		if (thrd_create(&thread, serve_connection, (void*)(intptr_t)fd) != thrd_success) {
+			LOGF_ERROR("server: could not start a connection thread");
+			close(fd);
+			continue;
+		}
+		thrd_detach(thread);
+	}
+
+	LOGF_INFO("server: shutting down");
+	close(listener);
+	unlink(path);
+	return status;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Serves assemble requests (see server.txt) on a Unix socket at `path` until
+// SIGINT or SIGTERM; returns the process exit code.
+int server_run(const char *path);
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "lc3std.h"
+#include "lc3stats.h"
+
+#include <stdatomic.h>
+
+bool stats_tryparse_format(const char *string, StatsFormat *format) {
+	if (string == NULL || string[0] == 0 || stricmp(string, "table") == 0) {
+		*format = SF_Table;
+		return true;
+	}
+	else if (stricmp(string, "json") == 0) {
+		*format = SF_Json;
+		return true;
+	}
+	return false;
+}
+
+#if LC3_STATS
+static const char *g_phase_names[SP_CountPlusOne] = {
+	[SP_Read] = "read",
+	[SP_Lex] = "lex",
+	[SP_Parse] = "parse",
+	[SP_Process] = "process_line",
+	[SP_Link] = "link",
+	[SP_Optimize] = "optimize",
+	[SP_Output] = "produce_obj",
+};
+static const char *g_counter_names[SC_CountPlusOne] = {
+	[SC_Lines] = "lines",
+	[SC_Tokens] = "tokens",
+	[SC_Labels] = "labels",
+	[SC_Fixups] = "fixups",
+	[SC_Mallocs] = "mallocs",
+	[SC_BytesWritten] = "bytes_written",
+	[SC_PeakMemory] = "peak_memory",
+	[SC_WordsSaved] = "words_saved",
+	[SC_Expansions] = "expansions",
+	[SC_ExpansionHits] = "expansion_hits",
+};
+
+static const char *g_stage_names[SS_CountPlusOne] = {
+	[SS_Read] = "read",
+	[SS_Lex] = "lex",
+	[SS_Encode] = "encode",
+	[SS_Write] = "write",
+	[SS_Pipeline] = "pipeline",
+};
+
+static bool g_enabled;
+static StatsFormat g_format;
+static FILE *g_target;
+static uint64_t g_start_ns;     // when stats were enabled, for the wall time
+// updated from every assembler thread with -j
+static _Atomic uint64_t g_phase_ns[SP_CountPlusOne];
+static _Atomic uint64_t g_counters[SC_CountPlusOne];
+static _Atomic uint64_t g_stage_ns[SS_CountPlusOne];
+
+// share of the pipeline's wall time that a stage spent working
+static double stage_utilization(int stage) {
+	return g_stage_ns[SS_Pipeline] ? (double)g_stage_ns[stage] / g_stage_ns[SS_Pipeline] : 0.0;
+}
+
+static void stats_report(void) {
+	uint64_t wall_ns = stats_now() - g_start_ns;
+	if (g_format == SF_Json) {
+		fprintf(g_target, "{\"wall_ns\":%llu,\"phases_ns\":{", (unsigned long long)wall_ns);
+		for (int i = SP_Read; i < SP_CountPlusOne; ++i) {
+			fprintf(g_target, "%s\"%s\":%llu", i == SP_Read ? "" : ",", g_phase_names[i], (unsigned long long)g_phase_ns[i]);
+		}
+		fputs("},\"counters\":{", g_target);
+		for (int i = SC_Lines; i < SC_CountPlusOne; ++i) {
+			fprintf(g_target, "%s\"%s\":%llu", i == SC_Lines ? "" : ",", g_counter_names[i], (unsigned long long)g_counters[i]);
+		}
+		fputc('}', g_target);
+		if (g_stage_ns[SS_Pipeline]) {
+			fprintf(g_target, ",\"pipeline_ns\":%llu,\"stages\":{", (unsigned long long)g_stage_ns[SS_Pipeline]);
+			for (int i = SS_Read; i < SS_Pipeline; ++i) {
+				fprintf(
+					g_target,
+					"%s\"%s\":{\"busy_ns\":%llu,\"utilization\":%.4f}",
+					i == SS_Read ? "" : ",",
+					g_stage_names[i],
+					(unsigned long long)g_stage_ns[i],
+					stage_utilization(i));
+			}
+			fputc('}', g_target);
+		}
+		fputs("}\n", g_target);
+	}
+	else {
+		uint64_t total_ns = 0;
+		for (int i = SP_Read; i < SP_CountPlusOne; ++i) {
+			total_ns += g_phase_ns[i];
+		}
+		fprintf(g_target, "%-14s %12s %7s\n", "phase", "time(ms)", "share");
+		for (int i = SP_Read; i < SP_CountPlusOne; ++i) {
+			fprintf(
+				g_target,
+				"%-14s %12.3f %6.1f%%\n",
+				g_phase_names[i],
+				g_phase_ns[i] / 1e6,
+				total_ns ? 100.0 * g_phase_ns[i] / total_ns : 0.0);
+		}
+		// with -j the phases of all threads add up, past the wall time
+		fprintf(g_target, "%-14s %12.3f\n", "thread total", total_ns / 1e6);
+		fprintf(g_target, "%-14s %12.3f\n", "wall", wall_ns / 1e6);
+		fprintf(g_target, "%-14s %12s\n", "counter", "value");
+		for (int i = SC_Lines; i < SC_CountPlusOne; ++i) {
+			fprintf(g_target, "%-14s %12llu\n", g_counter_names[i], (unsigned long long)g_counters[i]);
+		}
+		if (g_stage_ns[SS_Pipeline]) {
+			fprintf(g_target, "%-14s %12s %7s\n", "stage", "busy(ms)", "util");
+			for (int i = SS_Read; i < SS_CountPlusOne; ++i) {
+				fprintf(g_target, "%-14s %12.3f %6.1f%%\n", g_stage_names[i], g_stage_ns[i] / 1e6, 100.0 * stage_utilization(i));
+			}
+		}
+	}
+	fflush(g_target);
+}
+
+void stats_enable(StatsFormat format, FILE *target) {
+	if (g_enabled) {
+		return;
+	}
+	g_enabled = true;
+	g_format = format;
+	g_target = target;
+	g_start_ns = stats_now();
+	// assemble() leaves through exit(), so report from there
+	atexit(stats_report);
+}
+
+uint64_t stats_now(void) {
+	if (!g_enabled) {
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+uint64_t stats_lap(uint64_t start, StatsPhase phase) {
+	if (!g_enabled) {
+		return 0;
+	}
+	uint64_t now = stats_now();
+	g_phase_ns[phase] += now - start;
+	return now;
+}
+uint64_t stats_stage_lap(uint64_t start, StatsStage stage) {
+	if (!g_enabled) {
+		return 0;
+	}
+	uint64_t now = stats_now();
+	g_stage_ns[stage] += now - start;
+	return now;
+}
+void stats_count(StatsCounter counter, uint64_t amount) {
+	if (!g_enabled) {
+		// library callers never enable stats; keep their threads off the counters
+		return;
+	}
+	g_counters[counter] += amount;
+}
+void stats_peak(StatsCounter counter, uint64_t value) {
+	if (!g_enabled) {
+		return;
+	}
+	uint64_t current = g_counters[counter];
+	while (current < value && !atomic_compare_exchange_weak(&g_counters[counter], &current, value)) {
+	}
+}
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+// Build with -DLC3_STATS=0 to compile all instrumentation out.
+#ifndef LC3_STATS
+#define LC3_STATS 1
+#endif
+
+typedef enum StatsPhase {
+	SP_Read = 1,
+	SP_Lex,
+	SP_Parse,
+	SP_Process,
+	SP_Link,
+	SP_Optimize,
+	SP_Output,
+	SP_CountPlusOne,
+} StatsPhase;
+
+typedef enum StatsCounter {
+	SC_Lines = 1,
+	SC_Tokens,
+	SC_Labels,
+	SC_Fixups,
+	SC_Mallocs,
+	SC_BytesWritten,
+	SC_PeakMemory,
+	SC_WordsSaved,
+	SC_Expansions,
+	SC_ExpansionHits,
+	SC_CountPlusOne,
+} StatsCounter;
+
+// Pipeline stages of --batch; SS_Pipeline is the wall time of the whole run.
+typedef enum StatsStage {
+	SS_Read = 1,
+	SS_Lex,
+	SS_Encode,
+	SS_Write,
+	SS_Pipeline,
+	SS_CountPlusOne,
+} StatsStage;
+
+typedef enum StatsFormat {
+	SF_Table = 1,
+	SF_Json,
+} StatsFormat;
+
+bool stats_tryparse_format(const char *string, StatsFormat *format);
+
+#if LC3_STATS
+void stats_enable(StatsFormat format, FILE *target);
+uint64_t stats_now(void);
+uint64_t stats_lap(uint64_t start, StatsPhase phase);
+void stats_count(StatsCounter counter, uint64_t amount);
+void stats_peak(StatsCounter counter, uint64_t value);
+uint64_t stats_stage_lap(uint64_t start, StatsStage stage);
+
+#define STATS_CLOCK(clock) uint64_t clock = stats_now()
+#define STATS_LAP(clock, phase) ((clock) = stats_lap((clock), (phase)))
+#define STATS_COUNT(counter, amount) stats_count((counter), (amount))
+#define STATS_PEAK(counter, value) stats_peak((counter), (value))
+#define STATS_STAGE_LAP(clock, stage) ((clock) = stats_stage_lap((clock), (stage)))
+#else
+#define STATS_CLOCK(clock)
+#define STATS_LAP(clock, phase) ((void)0)
+#define STATS_COUNT(counter, amount) ((void)0)
+#define STATS_PEAK(counter, value) ((void)0)
+#define STATS_STAGE_LAP(clock, stage) ((void)0)
+#endif
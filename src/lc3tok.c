@@ -43,7 +43,14 @@ static IdentifierMeta Identifiers[] = {
 	{ NULL,    0,              { TDT_Void, { 0 } } },
 };
 static IdentifierMeta Directives[] = {
+	{ "blkw", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Blkw } },
+	{ "endm", TT_Directive, { TDT_DirectiveType, .directive_type = DT_EndMacro } },
+	{ "fill", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Fill } },
+	{ "incbin", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Incbin } },
+	{ "include", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Include } },
+	{ "macro", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Macro } },
 	{ "org", TT_Directive, { TDT_DirectiveType, .directive_type = DT_Origin } },
+	{ "stringp", TT_Directive, { TDT_DirectiveType, .directive_type = DT_StringP } },
 	{ "stringz", TT_Directive, { TDT_DirectiveType, .directive_type = DT_StringZ } },
 	{ NULL, TT_Directive, { TDT_DirectiveType, { 0 } } },
 };
@@ -53,10 +60,10 @@ static int is_identifier_begin(char c) {
 }
 
 static size_t unescape_char(const char *str, size_t length, char *result);
-static char *allocate_stringliteral(const char *cursor, size_t length);
+static char *allocate_stringliteral(const char *cursor, size_t length, Diagnostics *D);
 static int strnicmp(const char *lhs, const char *rhs, size_t maxlen);
 
-TokenType parse(const char *lexeme, size_t length, TokenData *tokenData) {
+TokenType parse(const char *lexeme, size_t length, TokenData *tokenData, Diagnostics *D) {
 	char c = lexeme[0];
 	if (is_identifier_begin(c)) {
 		for (IdentifierMeta *metaCursor = Identifiers; metaCursor->name; ++metaCursor) {
@@ -97,8 +104,9 @@ TokenType parse(const char *lexeme, size_t length, TokenData *tokenData) {
 		return TT_Number;
 	}
 	else if (c == '.') {
+		// whole names only: a prefix could name any directive added later
 		for (IdentifierMeta *metaCursor = Directives; metaCursor->name; ++metaCursor) {
-			if (strnicmp(metaCursor->name, lexeme + 1, length - 1) == 0) {
+			if (strlen(metaCursor->name) == length - 1 && strnicmp(metaCursor->name, lexeme + 1, length - 1) == 0) {
 				*tokenData = metaCursor->data;
 				return TT_Directive;
 			}
@@ -111,10 +119,10 @@ TokenType parse(const char *lexeme, size_t length, TokenData *tokenData) {
 		size_t i;
 		for (i = 1; i < length - 1; ++i) {
 			if (lexeme[i] == '\\') {
-				char *string = allocate_stringliteral(lexeme + 1, length - 2);
+				char *string = allocate_stringliteral(lexeme + 1, length - 2, D);
 				if (string) {
 					tokenData->dataType = TDT_StringOwned;
-					tokenData->string = allocate_stringliteral(lexeme + 1, length - 2);
+					tokenData->string = string;
 					return TT_String;
 				}
 				else {
@@ -154,19 +162,15 @@ TokenType parse(const char *lexeme, size_t length, TokenData *tokenData) {
 	}
 }
 
-static char* allocate_stringliteral(const char *readPtr, size_t length) {
-	char *buffer = malloc(length);
-	if (!buffer) {
-		fputs("ran out of memory!", stderr);
-		exit(FAILURE_MEMORY);
-	}
+static char* allocate_stringliteral(const char *readPtr, size_t length, Diagnostics *D) {
+	char *buffer = diag_alloc(D, length);
 	char *writePtr = buffer;
 	size_t i = 0;
 	while (i < length) {
 		char c;
 		size_t count = unescape_char(readPtr + i, length - i, &c);
 		if (count < 1) {
-			free(buffer);
+			diag_release(D, buffer);
 			return NULL;
 		}
 		i += count;
@@ -226,7 +230,7 @@ static int strnicmp(const char *lhs, const char *rhs, size_t maxlen) {
 	return 0;
 }
 
-StringSlice tokendata_expect_string(TokenData *tokenData) {
+StringSlice tokendata_expect_string(TokenData *tokenData, Diagnostics *D) {
 	switch (tokenData->dataType) {
 		case TDT_String:
 		case TDT_StringOwned:
@@ -234,21 +238,20 @@ StringSlice tokendata_expect_string(TokenData *tokenData) {
 		case TDT_StringSlice:
 			return tokenData->string_slice;
 		default:
-			fprintf(stderr, "tokendata_expect_string: expecting string-type; found (%u)\n", tokenData->dataType);
-			exit(FAILURE_INTERNAL);
+			diag_fatal(D, FAILURE_INTERNAL, "tokendata_expect_string: expecting string-type; found (%u)", tokenData->dataType);
 	}
 }
-void free_tokendata(TokenData *tokenData) {
+void free_tokendata(TokenData *tokenData, Diagnostics *D) {
 	if (tokenData == NULL) {
 		return;
 	}
 
 	switch (tokenData->dataType) {
 		case TDT_PointerOwned:
-			free(tokenData->pointer);
+			diag_release(D, tokenData->pointer);
 			break;
 		case TDT_StringOwned:
-			free(tokenData->string);
+			diag_release(D, tokenData->string);
 			break;
 		default:
 			break;
@@ -36,6 +36,13 @@ typedef enum DirectiveType {
 	DT_Invalid = 1,
 	DT_Origin,
 	DT_StringZ,
+	DT_Fill,
+	DT_Blkw,
+	DT_Incbin,
+	DT_StringP,
+	DT_Include,
+	DT_Macro,
+	DT_EndMacro,
 } DirectiveType;
 
 typedef enum TokenDataType {
@@ -68,7 +75,7 @@ typedef struct TokenData {
 } TokenData;
 
 // Functions
-TokenType parse(const char *lexeme, size_t length, TokenData *tokenData);
-StringSlice tokendata_expect_string(TokenData *tokenData);
-void free_tokendata(TokenData *tokenData);
+TokenType parse(const char *lexeme, size_t length, TokenData *tokenData, Diagnostics *D);
+StringSlice tokendata_expect_string(TokenData *tokenData, Diagnostics *D);
+void free_tokendata(TokenData *tokenData, Diagnostics *D);
 
@@ -0,0 +1,165 @@
+#include "lc3std.h"
+
+// Converts an LC3TRC span file (see trace.txt) to Chrome trace event JSON,
+// loadable in chrome://tracing or Perfetto.
+
+enum {
+	NO_DETAIL = 0xFFFF,
+};
+
+typedef enum SpanRecordType {
+	SRT_String = 1,
+	SRT_Begin,
+	SRT_End,
+} SpanRecordType;
+
+static char *g_strings[0x10000];
+
+static bool read_be(FILE *input, size_t size, uint64_t *value) {
+	uint8_t buffer[8];
+	if (fread(buffer, 1, size, input) != size) {
+		return false;
+	}
+	*value = 0;
+	for (size_t i = 0; i < size; ++i) {
+		*value = (*value << 8) | buffer[i];
+	}
+	return true;
+}
+
+static void write_json_string(FILE *output, const char *string) {
+	fputc('"', output);
+	for (; *string; ++string) {
+		unsigned char c = (unsigned char)*string;
+		if (c == '"' || c == '\\') {
+			fputc('\\', output);
+			fputc(c, output);
+		}
+		else if (c < 0x20) {
+			fprintf(output, "\\u%04x", c);
+		}
+		else {
+			fputc(c, output);
+		}
+	}
+	fputc('"', output);
+}
+
+static const char *lookup(uint64_t id) {
+	if (id >= NO_DETAIL || !g_strings[id]) {
+		fprintf(stderr, "reference to undefined string %llu\n", (unsigned long long)id);
+		exit(FAILURE_SYNTAX);
+	}
+	return g_strings[id];
+}
+
+static void truncated(void) {
+	fputs("truncated trace record\n", stderr);
+	exit(FAILURE_SYNTAX);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 3) {
+		fprintf(stderr, "usage: %s [trace.bin [trace.json]]\n", argv[0]);
+		return FAILURE_ARGS;
+	}
+	FILE *input = stdin;
+	FILE *output = stdout;
+	if (argc > 1 && !(input = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "could not open file \"%s\"\n", argv[1]);
+		return FAILURE_ARGS;
+	}
+	if (argc > 2 && !(output = fopen(argv[2], "w"))) {
+		fprintf(stderr, "could not open file \"%s\"\n", argv[2]);
+		return FAILURE_ARGS;
+	}
+
+	char magic[8];
+	if (fread(magic, 1, 8, input) != 8 || memcmp(magic, "LC3TRC", 6) != 0) {
+		fputs("not an LC3TRC file\n", stderr);
+		return FAILURE_SYNTAX;
+	}
+	if (magic[6] != 0) {
+		fprintf(stderr, "unsupported trace version %u.%u\n", magic[6], magic[7]);
+		return FAILURE_NOTIMPLEMENTED;
+	}
+
+	bool first = true;
+	bool have_origin = false;
+	uint64_t origin = 0;
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", output);
+	while (true) {
+		int type = fgetc(input);
+		if (type == EOF) {
+			break;
+		}
+		uint64_t id, detail = NO_DETAIL, thread, timestamp;
+		switch (type) {
+			case SRT_String: {
+				uint64_t length;
+				if (!read_be(input, 2, &id) || !read_be(input, 1, &length)) {
+					truncated();
+				}
+				char *string = malloc(length + 1);
+				if (!string) {
+					fputs("ran out of memory!\n", stderr);
+					return FAILURE_MEMORY;
+				}
+				if (fread(string, 1, length, input) != length) {
+					truncated();
+				}
+				string[length] = 0;
+				free(g_strings[id]);
+				g_strings[id] = string;
+				continue;
+			}
+			case SRT_Begin:
+				if (!read_be(input, 2, &id) || !read_be(input, 2, &detail)) {
+					truncated();
+				}
+				break;
+			case SRT_End:
+				if (!read_be(input, 2, &id)) {
+					truncated();
+				}
+				break;
+			default:
+				fprintf(stderr, "unrecognized record type (%i)\n", type);
+				return FAILURE_SYNTAX;
+		}
+		if (!read_be(input, 4, &thread) || !read_be(input, 8, &timestamp)) {
+			truncated();
+		}
+		if (!have_origin) {
+			origin = timestamp;
+			have_origin = true;
+		}
+
+		fputs(first ? "\n" : ",\n", output);
+		first = false;
+		fputs("{\"name\":", output);
+		write_json_string(output, lookup(id));
+		fprintf(
+			output,
+			",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu",
+			type == SRT_Begin ? 'B' : 'E',
+			(timestamp - origin) / 1e3,
+			(unsigned long long)thread);
+		if (detail != NO_DETAIL) {
+			fputs(",\"args\":{\"detail\":", output);
+			write_json_string(output, lookup(detail));
+			fputc('}', output);
+		}
+		fputc('}', output);
+	}
+	fputs("\n]}\n", output);
+
+	if (ferror(input)) {
+		fputs("error while reading trace\n", stderr);
+		return FAILURE_IO;
+	}
+	if (output != stdout) {
+		fclose(output);
+	}
+	return 0;
+}
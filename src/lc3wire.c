@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lc3std.h"
+#include "lc3wire.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool wire_read(int fd, void *buffer, size_t size) {
+	uint8_t *cursor = buffer;
+	while (size > 0) {
+		ssize_t count = read(fd, cursor, size);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return false;
+		}
+		cursor += count;
+		size -= count;
+	}
+	return true;
+}
+bool wire_write(int fd, const void *buffer, size_t size) {
+	const uint8_t *cursor = buffer;
+	while (size > 0) {
+		// a peer that went away must not take the process down with SIGPIPE
+		ssize_t count = send(fd, cursor, size, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return false;
+		}
+		cursor += count;
+		size -= count;
+	}
+	return true;
+}
+
+void wire_put_u16(uint8_t *cursor, uint16_t value) {
+	cursor[0] = value >> 8;
+	cursor[1] = value;
+}
+uint16_t wire_get_u16(const uint8_t *cursor) {
+	return (uint16_t)(cursor[0] << 8 | cursor[1]);
+}
+void wire_put_u32(uint8_t *cursor, uint32_t value) {
+	cursor[0] = value >> 24;
+	cursor[1] = value >> 16;
+	cursor[2] = value >> 8;
+	cursor[3] = value;
+}
+uint32_t wire_get_u32(const uint8_t *cursor) {
+	return (uint32_t)cursor[0] << 24 | (uint32_t)cursor[1] << 16 | (uint32_t)cursor[2] << 8 | cursor[3];
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Framing shared by `lc3asm --server` and lc3asmc; see server.txt.
+enum {
+	WIRE_VERSION = 2,
+	WIRE_REQUEST_SIZE = 20,
+	WIRE_RESPONSE_SIZE = 24,
+	WIRE_MAX_NAME = 4096,
+	WIRE_MAX_PAYLOAD = 1 << 26,
+};
+
+typedef enum WireRequestKind {
+	WRK_Path = 1,
+	WRK_Source,
+} WireRequestKind;
+
+typedef enum WireRequestFlags {
+	WRF_Dependencies = 1,   // return the files the source included
+	WRF_Optimize = 2,       // as lc3asm -O
+	WRF_Known = WRF_Dependencies | WRF_Optimize,
+} WireRequestFlags;
+
+// Transfer exactly `size` bytes; false on error or end of stream.
+bool wire_read(int fd, void *buffer, size_t size);
+bool wire_write(int fd, const void *buffer, size_t size);
+
+void wire_put_u16(uint8_t *cursor, uint16_t value);
+uint16_t wire_get_u16(const uint8_t *cursor);
+void wire_put_u32(uint8_t *cursor, uint32_t value);
+uint32_t wire_get_u32(const uint8_t *cursor);
@@ -0,0 +1,2313 @@
+#include "lc3asm.h"
+
+#include <threads.h>
+
+typedef struct Lexeme {
+	char *start;
+	size_t length;
+} Lexeme;
+typedef struct Token {
+	TokenType type;
+	TokenData data;
+	size_t column;
+} Token;
+typedef struct Argument {
+	Token *tokens;
+	size_t count;
+} Argument;
+typedef struct Line {
+	Token *statement;
+	Argument *args;
+	size_t nArgs;
+	Token *label;
+	Token *comment;
+} Line;
+
+enum {
+	MAX_LINE_CHARS = 4096,
+	MAX_LINE_TOKENS = 8,
+	STREAM_LINE_CHARS = 256,
+	MAX_INCLUDE_DEPTH = 16,
+	MAX_MACRO_PARAMS = MAX_LINE_TOKENS,
+	MAX_MACRO_DEPTH = 16,
+};
+
+// What a source is read into a line at a time; each level of .include read
+// this way has its own.
+typedef struct LineBuffers {
+	char *chars;
+	Lexeme *lexemes;
+	Token *tokens;
+	size_t nTokens;     // tokens of the current line that may own memory
+} LineBuffers;
+
+typedef struct IncludeEntry IncludeEntry;
+typedef struct Macro Macro;
+
+// Everything one lc3asm_assemble() call owns, so an abandoned assembly can be
+// released from wherever diag_fatal() left it.
+typedef struct Assembler {
+	Diagnostics diagnostics;
+	CompilationUnit CU;
+	LineBuffers lines[MAX_INCLUDE_DEPTH + 1];
+	size_t depth;               // of the .include being processed
+	char **includes;            // copies of the paths included so far
+	IncludeEntry **included;    // the cached files they name, held until the end; NULL for .incbin
+	size_t include_count;
+	size_t include_capacity;
+	Macro *macros;              // defined so far, newest first
+	Macro *defining;            // between .macro and .endm, or NULL
+	size_t defining_depth;      // .include depth of that .macro
+	size_t expanding;           // depth of macro expansion
+	const char *path;           // Lc3AsmOptions.path
+	uint8_t *object;
+	size_t object_size;
+	FILE *output;       // streaming: the object goes straight to this file
+	bool optimize;
+	size_t words_saved;
+	FILE *analysis;     // where the code report goes after linking, or NULL
+} Assembler;
+
+// Where assemble() reads its lines from: `buffer`, or `file` when streaming.
+typedef struct LineSource {
+	const char *buffer;
+	size_t length;
+	size_t position;
+	FILE *file;
+	size_t capacity;    // longest line plus its NUL
+} LineSource;
+
+typedef struct Chunk Chunk;
+
+// Source split into lines and tokens by lc3asm_parse(), waiting for
+// lc3asm_encode().
+struct Lc3AsmParsed {
+	const char *source;
+	size_t length;
+	Lc3AsmOptions options;
+	Chunk *chunk;
+};
+
+static bool try_assemble(Assembler *A, const char *source, size_t length);
+static bool try_assemble_lines(Assembler *A, LineSource *S);
+static bool try_assemble_parallel(Assembler *A, const char *source, size_t length, size_t threads);
+static bool try_encode(Assembler *A, Chunk *chunk);
+static Chunk *scan_source(const char *source, size_t length, const char *name, const Lc3Allocator *allocator);
+static void release_chunk(Chunk *chunk);
+static void release_tokens(Assembler *A, LineBuffers *lines);
+static void include_source(void *context, const char *name, size_t column);
+static bool incbin_file(void *context, const char *name, size_t column, MappedFile *file);
+static void include_release(IncludeEntry *entry);
+static void release_macros(Assembler *A);
+static void assemble_line(Assembler *A, Token *tokens, size_t nTokens);
+static void macro_source_end(Assembler *A);
+
+static void assembler_init(Assembler *A, const Lc3AsmOptions *options) {
+	memset(A, 0, sizeof(*A));
+	const char *name = options && options->name ? options->name : "<source>";
+	diag_init(&A->diagnostics, name, options ? options->error_limit : 0, options ? options->allocator : NULL);
+	A->CU.diagnostics = &A->diagnostics;
+	A->CU.include = include_source;
+	A->CU.incbin = incbin_file;
+	A->CU.include_context = A;
+	A->optimize = options && options->optimize;
+	A->analysis = options ? options->analysis : NULL;
+	A->path = options ? options->path : NULL;
+	A->CU.track_kinds = A->optimize || A->analysis;
+}
+static int assembler_finish(Assembler *A, Lc3AsmResult *result) {
+	for (size_t i = 0; i <= MAX_INCLUDE_DEPTH; ++i) {
+		LineBuffers *lines = &A->lines[i];
+		release_tokens(A, lines);
+		diag_release(&A->diagnostics, lines->chars);
+		diag_release(&A->diagnostics, lines->lexemes);
+		diag_release(&A->diagnostics, lines->tokens);
+	}
+	cu_free(&A->CU);
+	release_macros(A);
+	for (size_t i = 0; i < A->include_count; ++i) {
+		if (A->included[i]) {
+			include_release(A->included[i]);
+		}
+	}
+	diag_release(&A->diagnostics, A->included);
+
+	memset(result, 0, sizeof(*result));
+	result->status = diag_exit_code(&A->diagnostics);
+	result->limit_reached = diag_limit_reached(&A->diagnostics);
+	result->name = A->diagnostics.file;
+	result->words_saved = A->words_saved;
+	result->includes = A->includes;
+	result->include_count = A->include_count;
+	result->allocator = A->diagnostics.allocator;
+	if (result->status == EXIT_SUCCESS) {
+		result->object = A->object;
+		result->object_size = A->object_size;
+	}
+	else {
+		diag_release(&A->diagnostics, A->object);
+	}
+	// hand the diagnostics over as they are
+	result->diagnostics = A->diagnostics.items;
+	result->diagnostic_count = A->diagnostics.count;
+	return result->status;
+}
+
+int lc3asm_assemble(const char *source, size_t length, const Lc3AsmOptions *options, Lc3AsmResult *result) {
+	Assembler A;
+	assembler_init(&A, options);
+	// the optimizer and the analysis need the whole unit in one buffer
+	size_t threads = options && !A.CU.track_kinds ? options->threads : 0;
+	if (threads < 2 || !try_assemble_parallel(&A, source, length, threads)) {
+		try_assemble(&A, source, length);
+	}
+	return assembler_finish(&A, result);
+}
+
+Lc3AsmParsed *lc3asm_parse(const char *source, size_t length, const Lc3AsmOptions *options) {
+	Assembler A;
+	assembler_init(&A, options);
+	Lc3Allocator *allocator = &A.diagnostics.allocator;
+	Lc3AsmParsed *parsed = allocator->allocate(allocator->context, sizeof(Lc3AsmParsed));
+	if (!parsed) {
+		return NULL;
+	}
+	STATS_COUNT(SC_Mallocs, 1);
+	*parsed = (Lc3AsmParsed){ source, length, options ? *options : (Lc3AsmOptions){0}, NULL };
+	// NULL when the source does not scan cleanly; encode then assembles it from scratch
+	parsed->chunk = scan_source(source, length, A.diagnostics.file, options ? options->allocator : NULL);
+	return parsed;
+}
+int lc3asm_encode(Lc3AsmParsed *parsed, Lc3AsmResult *result) {
+	Assembler A;
+	assembler_init(&A, &parsed->options);
+	if (parsed->chunk) {
+		try_encode(&A, parsed->chunk);
+		release_chunk(parsed->chunk);
+	}
+	else {
+		try_assemble(&A, parsed->source, parsed->length);
+	}
+	diag_release(&A.diagnostics, parsed);
+	return assembler_finish(&A, result);
+}
+// Blocks under a budget carry its header, so the result gets plain copies of
+// the included paths, as it does of the diagnostics.
+static void unbudget_includes(Assembler *A) {
+	Diagnostics *D = &A->diagnostics;
+	Lc3Allocator *allocator = &D->allocator;
+	char **includes = NULL;
+	size_t count = 0;
+	if (A->include_count) {
+		includes = allocator->allocate(allocator->context, A->include_count * sizeof(char*));
+		STATS_COUNT(SC_Mallocs, 1);
+	}
+	for (size_t i = 0; i < A->include_count; ++i) {
+		size_t size = strlen(A->includes[i]) + 1;
+		char *copy = includes ? allocator->allocate(allocator->context, size) : NULL;
+		if (copy) {
+			STATS_COUNT(SC_Mallocs, 1);
+			memcpy(copy, A->includes[i], size);
+			includes[count++] = copy;
+		}
+		diag_release(D, A->includes[i]);
+	}
+	if (count < A->include_count) {
+		D->fatal = FAILURE_MEMORY;
+	}
+	diag_release(D, A->includes);
+	A->includes = includes;
+	A->include_count = count;
+}
+int lc3asm_assemble_stream(FILE *input, FILE *output, size_t memory_limit, const Lc3AsmOptions *options, Lc3AsmResult *result) {
+	Assembler A;
+	assembler_init(&A, options);
+	diag_set_budget(&A.diagnostics, memory_limit);
+	A.output = output;
+	A.optimize = false;
+	A.analysis = NULL;
+	A.CU.track_kinds = false;
+	A.CU.include = NULL;
+	LineSource lines = { NULL, 0, 0, input, STREAM_LINE_CHARS };
+	try_assemble_lines(&A, &lines);
+	size_t peak = A.diagnostics.peak;
+	unbudget_includes(&A);
+	assembler_finish(&A, result);
+	result->peak_memory = peak;
+	STATS_PEAK(SC_PeakMemory, peak);
+	return result->status;
+}
+void lc3asm_result_free(Lc3AsmResult *result) {
+	Lc3Allocator *allocator = &result->allocator;
+	for (size_t i = 0; i < result->diagnostic_count; ++i) {
+		Lc3Diagnostic *item = &result->diagnostics[i];
+		allocator->release(allocator->context, item->message);
+		if (item->source) {
+			allocator->release(allocator->context, item->source);
+		}
+		if (item->file) {
+			allocator->release(allocator->context, item->file);
+		}
+	}
+	if (result->diagnostics) {
+		allocator->release(allocator->context, result->diagnostics);
+	}
+	for (size_t i = 0; i < result->include_count; ++i) {
+		allocator->release(allocator->context, result->includes[i]);
+	}
+	if (result->includes) {
+		allocator->release(allocator->context, result->includes);
+	}
+	if (result->object) {
+		allocator->release(allocator->context, result->object);
+	}
+	result->diagnostics = NULL;
+	result->diagnostic_count = 0;
+	result->includes = NULL;
+	result->include_count = 0;
+	result->object = NULL;
+	result->object_size = 0;
+}
+void lc3asm_print_diagnostics(const Lc3AsmResult *result, FILE *output) {
+	diag_print(result->name, result->diagnostics, result->diagnostic_count, result->limit_reached, output);
+}
+void lc3asm_print_dependencies(const Lc3AsmResult *result, const char *target, const char *source, FILE *output) {
+	deps_print(target, source, result->includes, result->include_count, output);
+}
+
+static void assemble(Assembler *A, LineSource *S);
+static void read_lines(Assembler *A, LineSource *S);
+static void link_unit(Assembler *A);
+static bool try_assemble_lines(Assembler *A, LineSource *S) {
+	jmp_buf abandon;
+	if (setjmp(abandon)) {
+		// diag_fatal gave up on the assembly; A is released by the caller
+		A->diagnostics.abort = NULL;
+		return false;
+	}
+	A->diagnostics.abort = &abandon;
+	assemble(A, S);
+	A->diagnostics.abort = NULL;
+	return true;
+}
+static bool try_assemble(Assembler *A, const char *source, size_t length) {
+	LineSource lines = { source, length, 0, NULL, MAX_LINE_CHARS };
+	return try_assemble_lines(A, &lines);
+}
+static int source_line(LineSource *S, char *buffer);
+static bool source_more(LineSource *S);
+static int next_line(const char *source, size_t length, size_t *position, char *buffer, size_t capacity);
+static int lex_line(Diagnostics *D, char *line, Lexeme *lexemes);
+static bool parse_line(Diagnostics *D, const char *line, Lexeme *lexemes, size_t nLexemes, Token *tokens, size_t *nParsed);
+void process_line(CompilationUnit *CU, size_t line_number, Token *token, size_t nTokens);
+static bool try_process_line(CompilationUnit *CU, size_t line_number, Token *tokens, size_t nTokens);
+static const char *describe_invalid(const char *lexeme);
+static void line_buffers_init(Assembler *A, size_t capacity) {
+	Diagnostics *D = &A->diagnostics;
+	LineBuffers *lines = &A->lines[A->depth];
+	lines->chars = diag_alloc(D, capacity);
+	lines->lexemes = diag_alloc(D, MAX_LINE_TOKENS * sizeof(Lexeme));
+	lines->tokens = diag_alloc(D, MAX_LINE_TOKENS * sizeof(Token));
+}
+static void assemble(Assembler *A, LineSource *S) {
+	Diagnostics *D = &A->diagnostics;
+	line_buffers_init(A, S->capacity);
+	if (A->output) {
+		// the label table takes its share of the memory bound up front
+		cu_stream_init(&A->CU, A->output, D->budget / LC3ASM_STREAM_BYTES_PER_LABEL);
+	}
+
+	LOGF_INFO("assemble");
+	LOGF_TRACE("file read");
+	LOG_SPAN_BEGIN("source", NULL);
+	read_lines(A, S);
+	if (S->file && ferror(S->file)) {
+		diag_error(D, FAILURE_IO, 0, "error while reading input");
+	}
+
+	LOG_SPAN_END("source");
+	link_unit(A);
+}
+// Runs every line of S through the unit, reading them into the line buffers
+// of the current .include depth.
+static void read_lines(Assembler *A, LineSource *S) {
+	Diagnostics *D = &A->diagnostics;
+	LineBuffers *lines = &A->lines[A->depth];
+	if (!lines->chars) {
+		line_buffers_init(A, S->capacity);
+	}
+	char *line_chars = lines->chars;
+	Lexeme *line_lexemes = lines->lexemes;
+	Token *line_tokens = lines->tokens;
+	size_t line_number = 0;
+
+	STATS_CLOCK(clock);
+	do {
+		LOGF_TRACE("line read");
+		int line_length = source_line(S, line_chars);
+		line_number += 1;
+		D->line = line_number;
+		D->source = line_chars;
+		STATS_LAP(clock, SP_Read);
+		if (line_length < 0) {
+			diag_error(D, FAILURE_LIMITS, 0, "line longer than %zu characters", S->capacity - 1);
+			continue;
+		}
+		LOGF_TRACE("line lex");
+		int nTokens = lex_line(D, line_chars, line_lexemes);
+		if (nTokens < 0) {
+			continue;
+		}
+		STATS_LAP(clock, SP_Lex);
+		LOGF_TRACE("line parse");
+		bool parsed = parse_line(D, line_chars, line_lexemes, nTokens, line_tokens, &lines->nTokens);
+		STATS_COUNT(SC_Lines, 1);
+		STATS_COUNT(SC_Tokens, nTokens);
+		STATS_LAP(clock, SP_Parse);
+		if (parsed) {
+			LOGF_TRACE("line process");
+			assemble_line(A, line_tokens, nTokens);
+		}
+		LOGF_TRACE("line cleanup");
+		release_tokens(A, lines);
+		STATS_LAP(clock, SP_Process);
+	} while (source_more(S) && !diag_limit_reached(D));
+	D->line = 0;
+	D->source = NULL;
+	macro_source_end(A);
+}
+static void link_unit(Assembler *A) {
+	Diagnostics *D = &A->diagnostics;
+	if (A->CU.origin_set) {
+		if (!A->CU.stream) {
+			// streaming resolved every reference it could as the labels came
+			cu_resolve_linking(&A->CU);
+		}
+		if (A->optimize && D->count == 0) {
+			OptReport report;
+			opt_peephole(&A->CU, &report);
+			A->words_saved = report.removed;
+		}
+		if (A->analysis && D->count == 0) {
+			analysis_write(&A->CU, D->file, A->analysis);
+		}
+	}
+	else if (D->count == 0) {
+		diag_error(D, FAILURE_SYNTAX, 0, "no code found");
+	}
+
+	if (D->count == 0) {
+		LOGF_INFO("produce obj");
+		if (A->CU.stream) {
+			cu_stream_finish(&A->CU);
+		}
+		else {
+			cu_produce_obj(&A->CU, &A->object, &A->object_size);
+		}
+	}
+}
+// Splits a NUL-terminated line into at most MAX_LINE_TOKENS lexemes; returns
+// their count, or -1 after recording why the line cannot be lexed.
+static int lex_line(Diagnostics *D, char *line, Lexeme *lexemes) {
+	char *cursor = line;
+	int nLexemes = 0;
+	while (true) {
+		char *lexeme = next_lexeme(&cursor);
+		if (lexeme == NULL) {
+			diag_error(
+				D,
+				FAILURE_SYNTAX,
+				cursor - line + 1,
+				*cursor == '"' || *cursor == '\'' ? "unterminated string constant" : "unexpected character '%c'",
+				*cursor);
+			return -1;
+		}
+		else if (lexeme == cursor) {
+			// line is complete
+			return nLexemes;
+		}
+		if (nLexemes >= MAX_LINE_TOKENS) {
+			diag_error(
+				D,
+				FAILURE_LIMITS,
+				lexeme - line + 1,
+				"too many tokens on line (limit is %u)",
+				MAX_LINE_TOKENS);
+			return -1;
+		}
+		lexemes[nLexemes++] = (Lexeme){ lexeme, cursor - lexeme };
+	}
+}
+// Parses lexemes into tokens; `nParsed` tracks the tokens that may own memory
+// (including an invalid one) so they can be released even after a longjmp.
+static bool parse_line(Diagnostics *D, const char *line, Lexeme *lexemes, size_t nLexemes, Token *tokens, size_t *nParsed) {
+	for (size_t i = 0; i < nLexemes; ++i) {
+		Token *token = &tokens[i];
+		Lexeme *lexeme = &lexemes[i];
+		token->type = parse(lexeme->start, lexeme->length, &token->data, D);
+		token->column = lexeme->start - line + 1;
+		*nParsed = i + 1;
+		if (token->type == TT_Invalid) {
+			diag_error(
+				D,
+				FAILURE_SYNTAX,
+				token->column,
+				describe_invalid(lexeme->start),
+				(int)lexeme->length,
+				lexeme->start);
+			return false;
+		}
+	}
+	return true;
+}
+static void release_tokens(Assembler *A, LineBuffers *lines) {
+	for (size_t i = 0; i < lines->nTokens; ++i) {
+		free_tokendata(&lines->tokens[i].data, &A->diagnostics);
+	}
+	lines->nTokens = 0;
+}
+// Copies the next line of `source` into `buffer`; a line ends at "\n", "\r",
+// "\r\n" or "\n\r". Returns the line length, or -1 when the line did not fit
+// (the rest of the line is skipped so that reading resumes on the next one).
+static int next_line(const char *source, size_t length, size_t *position, char *buffer, size_t capacity) {
+	size_t i = 0;
+	size_t p = *position;
+	bool overflow = false;
+	while (p < length) {
+		char c = source[p++];
+		if (c == '\n' || c == '\r') {
+			if (p < length && source[p] != c && (source[p] == '\n' || source[p] == '\r')) {
+				p += 1;
+			}
+			break;
+		}
+		if (i + 1 >= capacity) {
+			overflow = true;
+			continue;
+		}
+		buffer[i++] = c;
+	}
+	buffer[i] = 0;
+	*position = p;
+	return overflow ? -1 : (int)i;
+}
+// Like next_line(), reading from a file.
+static int next_file_line(FILE *file, char *buffer, size_t capacity) {
+	size_t i = 0;
+	bool overflow = false;
+	int c;
+	while ((c = getc(file)) != EOF) {
+		if (c == '\n' || c == '\r') {
+			int next = getc(file);
+			if (next != EOF && (next == c || (next != '\n' && next != '\r'))) {
+				ungetc(next, file);
+			}
+			break;
+		}
+		if (i + 1 >= capacity) {
+			overflow = true;
+			continue;
+		}
+		buffer[i++] = c;
+	}
+	buffer[i] = 0;
+	return overflow ? -1 : (int)i;
+}
+static int source_line(LineSource *S, char *buffer) {
+	if (S->file) {
+		return next_file_line(S->file, buffer, S->capacity);
+	}
+	return next_line(S->buffer, S->length, &S->position, buffer, S->capacity);
+}
+static bool source_more(LineSource *S) {
+	if (S->file) {
+		int c = getc(S->file);
+		return c != EOF && ungetc(c, S->file) != EOF;
+	}
+	return S->position < S->length;
+}
+static bool try_process_line(CompilationUnit *CU, size_t line_number, Token *tokens, size_t nTokens) {
+	jmp_buf recover;
+	if (setjmp(recover)) {
+		// diag_fail abandoned the line; its diagnostic is already recorded
+		CU->diagnostics->recover = NULL;
+		return false;
+	}
+	CU->diagnostics->recover = &recover;
+	process_line(CU, line_number, tokens, nTokens);
+	CU->diagnostics->recover = NULL;
+	return true;
+}
+// Returns a format for an invalid lexeme; takes its length and start.
+static const char *describe_invalid(const char *lexeme) {
+	switch (lexeme[0]) {
+		case '.':
+			return "unrecognized directive '%.*s'";
+		case '#':
+			return "invalid decimal number '%.*s'";
+		case '"':
+			return "invalid escape sequence in %.*s";
+		case '\'':
+			return "invalid character constant %.*s";
+		default:
+			return "unexpected '%.*s'";
+	}
+}
+
+// == Parallel assembly ==
+// The source is split at line starts into one chunk per thread. Each chunk is
+// lexed, parsed and sized on its own thread; the .org line, the prefix sum of
+// chunk sizes and the labels are then handled in source order, and finally
+// every chunk encodes its lines through a view of the shared unit. Any error
+// abandons the attempt and the source is assembled serially instead, so the
+// object and the diagnostics are always exactly those of the serial path.
+
+enum {
+	PARALLEL_MIN_CHUNK = 1 << 16,
+};
+
+typedef struct ChunkLine {
+	const char *text;
+	size_t first_token;
+	size_t nTokens;
+	size_t words;
+	bool labeled;   // tokens[first_token] is the label of the line
+	bool origin;    // the .org line; processed before the chunks are encoded
+} ChunkLine;
+
+struct Chunk {
+	const char *start;
+	size_t length;
+	bool sized;             // size lines for the parallel path; any other shape fails the chunk
+	char *text;             // the chunk's lines, each NUL-terminated
+	Token *tokens;
+	size_t nTokens;
+	size_t nPending;        // tokens of the line being parsed that may own memory
+	size_t token_capacity;
+	ChunkLine *lines;
+	size_t nLines;
+	size_t line_capacity;
+	size_t words;
+	size_t first_line;      // line number of lines[0]
+	size_t offset;          // word offset of the chunk from the origin
+	bool failed;
+	void (*stage)(struct Chunk *chunk);
+	thrd_t thread;
+	bool started;
+	Diagnostics diagnostics;
+	CompilationUnit view;
+};
+
+typedef struct Parallel {
+	Assembler *A;
+	const char *source;
+	size_t length;
+	Chunk *chunks;
+	size_t nChunks;
+} Parallel;
+
+static bool is_newline(char c) {
+	return c == '\n' || c == '\r';
+}
+
+// A character after a line break always starts a line, however the breaks
+// before it pair up, so chunks start at the first such character from `from`.
+static size_t next_chunk_start(const char *source, size_t length, size_t from) {
+	for (size_t i = from > 0 ? from : 1; i < length; ++i) {
+		if (is_newline(source[i - 1]) && !is_newline(source[i])) {
+			return i;
+		}
+	}
+	return length;
+}
+
+static void chunk_fail(Chunk *chunk) {
+	// the serial pass will say what is wrong
+	chunk->failed = true;
+}
+
+// Sizes one parsed line the way process_line would emit it.
+static void chunk_size_line(Chunk *chunk, ChunkLine *line) {
+	Token *tokens = &chunk->tokens[line->first_token];
+	size_t count = line->nTokens;
+	if (count > 0 && tokens[count - 1].type == TT_Comment) {
+		count -= 1;
+	}
+	if (count == 0) {
+		return;
+	}
+	line->labeled = tokens[0].type == TT_Identifier;
+	Token *statement = line->labeled ? &tokens[1] : tokens;
+	size_t nArgs = line->labeled ? count - 1 : count;
+	if (nArgs == 0) {
+		chunk_fail(chunk);
+		return;
+	}
+	switch (statement->type) {
+		case TT_Instruction:
+		case TT_WordLiteral:
+			line->words = 1;
+			break;
+		case TT_Directive:
+			if (statement->data.directive_type == DT_Origin && !line->labeled) {
+				line->origin = true;
+			}
+			else if (statement->data.directive_type == DT_StringZ && nArgs == 2 && statement[1].type == TT_String) {
+				line->words = tokendata_expect_string(&statement[1].data, &chunk->diagnostics).length + 1;
+			}
+			else if (statement->data.directive_type == DT_StringP && nArgs == 2 && statement[1].type == TT_String) {
+				line->words = (tokendata_expect_string(&statement[1].data, &chunk->diagnostics).length + 1) / 2 + 1;
+			}
+			else if (statement->data.directive_type == DT_Fill && nArgs == 2) {
+				line->words = 1;
+			}
+			else if (statement->data.directive_type == DT_Blkw && nArgs >= 2 && statement[1].type == TT_Number
+				&& statement[1].data.integer >= 1 && statement[1].data.integer <= 0xFFFF) {
+				line->words = statement[1].data.integer;
+			}
+			else {
+				chunk_fail(chunk);
+			}
+			break;
+		default:
+			chunk_fail(chunk);
+			break;
+	}
+}
+
+static void chunk_scan(Chunk *chunk) {
+	Diagnostics *D = &chunk->diagnostics;
+	LOG_SPAN_BEGIN("scan_chunk", NULL);
+	STATS_CLOCK(clock);
+	chunk->text = diag_alloc(D, chunk->length + 1);
+	char *text = chunk->text;
+	Lexeme lexemes[MAX_LINE_TOKENS];
+	size_t position = 0;
+	do {
+		if (chunk->nLines == chunk->line_capacity) {
+			chunk->line_capacity = chunk->line_capacity ? chunk->line_capacity * 2 : 1024;
+			chunk->lines = diag_realloc(D, chunk->lines, chunk->line_capacity * sizeof(ChunkLine));
+		}
+		if (chunk->token_capacity - chunk->nTokens < MAX_LINE_TOKENS) {
+			chunk->token_capacity = chunk->token_capacity ? chunk->token_capacity * 2 : 4096;
+			chunk->tokens = diag_realloc(D, chunk->tokens, chunk->token_capacity * sizeof(Token));
+		}
+		// never longer than the bytes it was copied from, plus its NUL
+		int line_length = next_line(chunk->start, chunk->length, &position, text, MAX_LINE_CHARS);
+		STATS_LAP(clock, SP_Read);
+		if (line_length < 0) {
+			chunk_fail(chunk);
+			break;
+		}
+		int nTokens = lex_line(D, text, lexemes);
+		if (nTokens < 0) {
+			break;
+		}
+		STATS_LAP(clock, SP_Lex);
+		Token *tokens = &chunk->tokens[chunk->nTokens];
+		bool parsed = parse_line(D, text, lexemes, nTokens, tokens, &chunk->nPending);
+		chunk->nTokens += chunk->nPending;
+		chunk->nPending = 0;
+		STATS_LAP(clock, SP_Parse);
+		if (!parsed) {
+			break;
+		}
+		ChunkLine *line = &chunk->lines[chunk->nLines++];
+		*line = (ChunkLine){ text, chunk->nTokens - nTokens, nTokens, 0, false, false };
+		if (chunk->sized) {
+			chunk_size_line(chunk, line);
+		}
+		chunk->words += line->words;
+		text += line_length + 1;
+	} while (position < chunk->length && !chunk->failed);
+	LOG_SPAN_END("scan_chunk");
+}
+
+static void chunk_encode(Chunk *chunk) {
+	Diagnostics *D = &chunk->diagnostics;
+	LOG_SPAN_BEGIN("encode_chunk", NULL);
+	STATS_CLOCK(clock);
+	for (size_t i = 0; i < chunk->nLines; ++i) {
+		ChunkLine *line = &chunk->lines[i];
+		if (line->origin) {
+			continue;
+		}
+		D->line = chunk->first_line + i;
+		process_line(&chunk->view, D->line, &chunk->tokens[line->first_token], line->nTokens);
+	}
+	D->line = 0;
+	if (chunk->view.buffer_offset != chunk->words) {
+		diag_fatal(D, FAILURE_INTERNAL, "chunk encoded %zu words; expected %zu", chunk->view.buffer_offset, chunk->words);
+	}
+	STATS_LAP(clock, SP_Process);
+	LOG_SPAN_END("encode_chunk");
+}
+
+static int chunk_run(void *arg) {
+	Chunk *chunk = arg;
+	jmp_buf abandon;
+	if (setjmp(abandon)) {
+		chunk->diagnostics.abort = NULL;
+		chunk->failed = true;
+		return 0;
+	}
+	chunk->diagnostics.abort = &abandon;
+	chunk->stage(chunk);
+	chunk->diagnostics.abort = NULL;
+	if (chunk->diagnostics.count > 0) {
+		chunk->failed = true;
+	}
+	return 0;
+}
+
+// Runs `stage` on every chunk, one thread each; false if any chunk failed.
+static bool run_stage(Parallel *P, void (*stage)(Chunk *chunk)) {
+	for (size_t i = 0; i < P->nChunks; ++i) {
+		Chunk *chunk = &P->chunks[i];
+		chunk->stage = stage;
+		// the first chunk runs here, as does any chunk whose thread cannot start
+		chunk->started = i > 0 && thrd_create(&chunk->thread, chunk_run, chunk) == thrd_success;
+		if (!chunk->started && i > 0) {
+			chunk_run(chunk);
+		}
+	}
+	chunk_run(&P->chunks[0]);
+	bool ok = true;
+	for (size_t i = 0; i < P->nChunks; ++i) {
+		Chunk *chunk = &P->chunks[i];
+		if (chunk->started) {
+			thrd_join(chunk->thread, NULL);
+			chunk->started = false;
+		}
+		ok = ok && !chunk->failed;
+	}
+	return ok;
+}
+
+// Everything between the two parallel stages, in source order; false when
+// the serial pass has to take over.
+static bool link_chunks(Parallel *P) {
+	Assembler *A = P->A;
+	CompilationUnit *CU = &A->CU;
+
+	// the one .org must come before any code
+	size_t line_number = 1;
+	size_t words = 0;
+	ChunkLine *origin = NULL;
+	Chunk *origin_chunk = NULL;
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		Chunk *chunk = &P->chunks[c];
+		chunk->first_line = line_number;
+		line_number += chunk->nLines;
+		for (size_t i = 0; i < chunk->nLines; ++i) {
+			ChunkLine *line = &chunk->lines[i];
+			if (line->origin) {
+				if (origin || words > 0) {
+					return false;
+				}
+				origin = line;
+				origin_chunk = chunk;
+				A->diagnostics.line = chunk->first_line + i;
+			}
+			words += line->words;
+		}
+	}
+	if (!origin || words == 0) {
+		return false;
+	}
+	process_line(CU, A->diagnostics.line, &origin_chunk->tokens[origin->first_token], origin->nTokens);
+	A->diagnostics.line = 0;
+	if (A->diagnostics.count > 0 || words > 0x10000u - CU->origin) {
+		return false;
+	}
+
+	// prefix sum of the chunk sizes, then the labels in source order
+	cu_reserve(CU, words);
+	size_t offset = 0;
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		Chunk *chunk = &P->chunks[c];
+		chunk->offset = offset;
+		for (size_t i = 0; i < chunk->nLines; ++i) {
+			ChunkLine *line = &chunk->lines[i];
+			if (line->labeled) {
+				StringSlice slice = tokendata_expect_string(&chunk->tokens[line->first_token].data, &A->diagnostics);
+				A->diagnostics.line = chunk->first_line + i;
+				cu_register_label(CU, slice.start, slice.length, CU->origin + offset);
+			}
+			offset += line->words;
+		}
+		cu_view_init(&chunk->view, CU, &chunk->diagnostics, chunk->offset, chunk->words);
+	}
+	A->diagnostics.line = 0;
+	return true;
+}
+
+static void assemble_parallel(Parallel *P) {
+	Assembler *A = P->A;
+	Diagnostics *D = &A->diagnostics;
+	P->chunks = diag_alloc(D, P->nChunks * sizeof(Chunk));
+	memset(P->chunks, 0, P->nChunks * sizeof(Chunk));
+	size_t start = 0;
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		Chunk *chunk = &P->chunks[c];
+		size_t end = c + 1 == P->nChunks ? P->length : next_chunk_start(P->source, P->length, P->length / P->nChunks * (c + 1));
+		if (end < start) {
+			end = start;
+		}
+		chunk->start = P->source + start;
+		chunk->length = end - start;
+		chunk->sized = true;
+		diag_init(&chunk->diagnostics, D->file, 0, &D->allocator);
+		start = end;
+	}
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		if (P->chunks[c].length == 0) {
+			// fewer line starts than chunks
+			return;
+		}
+	}
+
+	LOG_SPAN_BEGIN("source", NULL);
+	bool ok = run_stage(P, chunk_scan) && link_chunks(P) && run_stage(P, chunk_encode);
+	LOG_SPAN_END("source");
+	if (!ok) {
+		return;
+	}
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		// counted only now, as a serial pass after a failed one counts them again
+		STATS_COUNT(SC_Lines, P->chunks[c].nLines);
+		STATS_COUNT(SC_Tokens, P->chunks[c].nTokens);
+		cu_view_merge(&A->CU, &P->chunks[c].view);
+	}
+	link_unit(A);
+}
+static bool try_assemble_parallel_guarded(Parallel *P) {
+	jmp_buf abandon;
+	if (setjmp(abandon)) {
+		P->A->diagnostics.abort = NULL;
+		return false;
+	}
+	P->A->diagnostics.abort = &abandon;
+	assemble_parallel(P);
+	P->A->diagnostics.abort = NULL;
+	return P->A->object != NULL;
+}
+static void clear_chunk(Chunk *chunk, Diagnostics *D) {
+	for (size_t i = 0; i < chunk->nTokens + chunk->nPending; ++i) {
+		free_tokendata(&chunk->tokens[i].data, D);
+	}
+	cu_free(&chunk->view);
+	diag_release(D, chunk->tokens);
+	diag_release(D, chunk->lines);
+	diag_release(D, chunk->text);
+	diag_free(&chunk->diagnostics);
+}
+static void release_chunks(Parallel *P) {
+	if (!P->chunks) {
+		return;
+	}
+	Diagnostics *D = &P->A->diagnostics;
+	for (size_t c = 0; c < P->nChunks; ++c) {
+		clear_chunk(&P->chunks[c], D);
+	}
+	diag_release(D, P->chunks);
+	P->chunks = NULL;
+}
+// Assembles into A with `threads` threads; false (with A left as it was) when
+// the source is too small to split or anything in it needs the serial pass.
+static bool try_assemble_parallel(Assembler *A, const char *source, size_t length, size_t threads) {
+	size_t nChunks = length / PARALLEL_MIN_CHUNK;
+	if (nChunks > threads) {
+		nChunks = threads;
+	}
+	if (nChunks < 2) {
+		return false;
+	}
+	LOGF_INFO("assemble with %zu threads", nChunks);
+	Parallel P = { A, source, length, NULL, nChunks };
+	bool ok = try_assemble_parallel_guarded(&P);
+	release_chunks(&P);
+	if (!ok) {
+		LOGF_INFO("parallel assembly abandoned; assembling serially");
+		diag_release(&A->diagnostics, A->object);
+		A->object = NULL;
+		A->object_size = 0;
+		cu_free(&A->CU);
+		memset(&A->CU, 0, sizeof(A->CU));
+		A->CU.diagnostics = &A->diagnostics;
+		A->CU.include = include_source;
+		A->CU.incbin = incbin_file;
+		A->CU.include_context = A;
+		diag_free(&A->diagnostics);
+		A->diagnostics.fatal = 0;
+	}
+	return ok;
+}
+
+// == Staged assembly ==
+// lc3asm_parse() scans the whole source as one unsized chunk; lc3asm_encode()
+// then runs its lines through process_line() just as assemble() would. Only a
+// source that scans without errors is staged, so the diagnostics of encode
+// come out in the same order as those of the serial path.
+
+static Chunk *scan_source(const char *source, size_t length, const char *name, const Lc3Allocator *allocator) {
+	Diagnostics D;
+	diag_init(&D, name, 0, allocator);
+	Chunk *chunk = D.allocator.allocate(D.allocator.context, sizeof(Chunk));
+	if (!chunk) {
+		return NULL;
+	}
+	STATS_COUNT(SC_Mallocs, 1);
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->start = source;
+	chunk->length = length;
+	chunk->diagnostics = D;
+	chunk->stage = chunk_scan;
+	chunk_run(chunk);
+	if (chunk->failed) {
+		release_chunk(chunk);
+		return NULL;
+	}
+	return chunk;
+}
+static void release_chunk(Chunk *chunk) {
+	Diagnostics D = chunk->diagnostics;
+	clear_chunk(chunk, &D);
+	diag_release(&D, chunk);
+}
+
+static void encode_lines(Assembler *A, Chunk *chunk) {
+	Diagnostics *D = &A->diagnostics;
+	for (size_t i = 0; i < chunk->nLines && !diag_limit_reached(D); ++i) {
+		ChunkLine *line = &chunk->lines[i];
+		D->line = i + 1;
+		D->source = line->text;
+		STATS_COUNT(SC_Lines, 1);
+		STATS_COUNT(SC_Tokens, line->nTokens);
+		assemble_line(A, &chunk->tokens[line->first_token], line->nTokens);
+	}
+	D->line = 0;
+	D->source = NULL;
+	macro_source_end(A);
+}
+static void encode(Assembler *A, Chunk *chunk) {
+	LOGF_INFO("encode");
+	LOG_SPAN_BEGIN("source", NULL);
+	STATS_CLOCK(clock);
+	encode_lines(A, chunk);
+	STATS_LAP(clock, SP_Process);
+	LOG_SPAN_END("source");
+	link_unit(A);
+}
+static bool try_encode(Assembler *A, Chunk *chunk) {
+	jmp_buf abandon;
+	if (setjmp(abandon)) {
+		A->diagnostics.abort = NULL;
+		return false;
+	}
+	A->diagnostics.abort = &abandon;
+	encode(A, chunk);
+	A->diagnostics.abort = NULL;
+	return true;
+}
+
+// == Included sources ==
+// A file named by .include is mapped, scanned into an unsized chunk as
+// lc3asm_parse() would and kept for the life of the process, so that batch
+// and server runs tokenize a shared file only once. Entries are found by
+// device and inode and used while the size and modification time still
+// match; one that changed is dropped once the last assembly using it is done.
+// Cached tokens are only ever read, so any number of assemblies can encode
+// the same entry at once. A file that does not scan cleanly is kept as text
+// and read line by line each time, which reports its errors as usual.
+
+struct IncludeEntry {
+	FileId id;
+	char *path;         // as it was first included
+	Chunk *chunk;       // NULL when the file does not scan cleanly
+	char *text;         // and then its text
+	size_t length;
+	size_t refs;        // assemblies holding the entry
+	bool stale;         // out of the cache; freed with its last reference
+	IncludeEntry *next;
+};
+
+static once_flag g_include_once = ONCE_FLAG_INIT;
+static mtx_t g_include_lock;
+static bool g_include_ready;    // without a lock, nothing is cached
+static IncludeEntry *g_includes;
+
+static void include_cache_init(void) {
+	g_include_ready = mtx_init(&g_include_lock, mtx_plain) == thrd_success;
+}
+static bool same_file(const FileId *a, const FileId *b) {
+	return a->device == b->device && a->inode == b->inode;
+}
+static bool same_version(const FileId *a, const FileId *b) {
+	return same_file(a, b) && a->size == b->size && a->modified == b->modified;
+}
+static void include_free(IncludeEntry *entry) {
+	if (entry->chunk) {
+		release_chunk(entry->chunk);
+	}
+	free(entry->text);
+	free(entry->path);
+	free(entry);
+}
+// Maps and scans `path`; NULL with `failure` set when that is not possible.
+static IncludeEntry *include_load(const char *path, int *failure) {
+	MappedFile file;
+	if (!map_file(path, &file)) {
+		*failure = FAILURE_IO;
+		return NULL;
+	}
+	size_t length = strlen(path);
+	IncludeEntry *entry = calloc(1, sizeof(IncludeEntry));
+	if (entry) {
+		entry->path = malloc(length + 1);
+	}
+	if (!entry || !entry->path) {
+		free(entry);
+		unmap_file(&file);
+		*failure = FAILURE_MEMORY;
+		return NULL;
+	}
+	STATS_COUNT(SC_Mallocs, 2);
+	memcpy(entry->path, path, length + 1);
+	entry->id = file.id;
+	entry->refs = 1;
+	const char *source = file.data ? (const char*)file.data : "";
+	entry->chunk = scan_source(source, file.size, entry->path, NULL);
+	if (!entry->chunk) {
+		entry->text = malloc(file.size + 1);
+		if (!entry->text) {
+			unmap_file(&file);
+			include_free(entry);
+			*failure = FAILURE_MEMORY;
+			return NULL;
+		}
+		STATS_COUNT(SC_Mallocs, 1);
+		memcpy(entry->text, source, file.size);
+		entry->length = file.size;
+	}
+	unmap_file(&file);
+	return entry;
+}
+// Returns the entry for the file `id` found at `path`, loading it unless the
+// cache has it; the caller holds a reference until include_release().
+static IncludeEntry *include_acquire(const char *path, const FileId *id, int *failure) {
+	call_once(&g_include_once, include_cache_init);
+	if (g_include_ready) {
+		IncludeEntry *found = NULL;
+		mtx_lock(&g_include_lock);
+		IncludeEntry **link = &g_includes;
+		while (*link && !found) {
+			IncludeEntry *entry = *link;
+			if (!same_file(&entry->id, id)) {
+				link = &entry->next;
+			}
+			else if (same_version(&entry->id, id)) {
+				entry->refs += 1;
+				found = entry;
+			}
+			else {
+				// the file changed since it was cached
+				*link = entry->next;
+				entry->stale = true;
+				if (entry->refs == 0) {
+					include_free(entry);
+				}
+			}
+		}
+		mtx_unlock(&g_include_lock);
+		if (found) {
+			LOGF_DEBUG("include: %s from the cache", path);
+			return found;
+		}
+	}
+	IncludeEntry *entry = include_load(path, failure);
+	if (!entry) {
+		return NULL;
+	}
+	if (!g_include_ready) {
+		entry->stale = true;
+		return entry;
+	}
+	mtx_lock(&g_include_lock);
+	entry->next = g_includes;
+	g_includes = entry;
+	mtx_unlock(&g_include_lock);
+	return entry;
+}
+static void include_release(IncludeEntry *entry) {
+	if (g_include_ready) {
+		mtx_lock(&g_include_lock);
+	}
+	entry->refs -= 1;
+	bool unused = entry->stale && entry->refs == 0;
+	if (g_include_ready) {
+		mtx_unlock(&g_include_lock);
+	}
+	if (unused) {
+		include_free(entry);
+	}
+}
+
+static size_t directory_length(const char *path) {
+	const char *slash = path ? strrchr(path, '/') : NULL;
+	return slash ? (size_t)(slash - path) + 1 : 0;
+}
+// Returns a copy of `path`, taken from the directory of `from` unless it is
+// absolute.
+static char *include_path(Diagnostics *D, const char *from, const char *path) {
+	size_t directory = path[0] != '/' ? directory_length(from) : 0;
+	size_t length = strlen(path);
+	char *copy = diag_alloc(D, directory + length + 1);
+	memcpy(copy, from, directory);
+	memcpy(copy + directory, path, length + 1);
+	return copy;
+}
+// Returns the path of the file `name` named on the current line, taken from
+// the directory of that line's file unless it is absolute. Paths are named as
+// seen from the source name; with Lc3AsmOptions.path, `opened` gets a copy to
+// open the file by from its directory instead, else NULL.
+static char *source_path(Assembler *A, const char *name, char **opened) {
+	Diagnostics *D = &A->diagnostics;
+	char *path = include_path(D, D->include ? D->include : D->file, name);
+	*opened = A->path && path[0] != '/' ? include_path(D, A->path, path + directory_length(D->file)) : NULL;
+	return path;
+}
+// Lists `path` with the files the result depends on; `entry` is NULL for a
+// file that is not a source.
+static void add_include(Assembler *A, char *path, IncludeEntry *entry) {
+	Diagnostics *D = &A->diagnostics;
+	if (A->include_count == A->include_capacity) {
+		A->include_capacity = A->include_capacity ? A->include_capacity * 2 : 8;
+		A->includes = diag_realloc(D, A->includes, A->include_capacity * sizeof(char*));
+		A->included = diag_realloc(D, A->included, A->include_capacity * sizeof(IncludeEntry*));
+	}
+	A->includes[A->include_count] = path;
+	A->included[A->include_count] = entry;
+	A->include_count += 1;
+}
+// Maps the file `name` of an .incbin, found as .include finds its files, and
+// lists it with the included files; false once the error is reported.
+static bool incbin_file(void *context, const char *name, size_t column, MappedFile *file) {
+	Assembler *A = context;
+	Diagnostics *D = &A->diagnostics;
+	char *opened;
+	char *path = source_path(A, name, &opened);
+	bool mapped = map_file(opened ? opened : path, file);
+	diag_release(D, opened);
+	if (!mapped) {
+		diag_error(D, FAILURE_IO, column, "could not read file \"%s\"", path);
+		diag_release(D, path);
+		return false;
+	}
+	for (size_t i = 0; i < A->include_count; ++i) {
+		if (strcmp(A->includes[i], path) == 0) {
+			diag_release(D, path);
+			return true;
+		}
+	}
+	add_include(A, path, NULL);
+	return true;
+}
+// Runs the lines of the file `name` through the unit in place of the .include
+// line; a file already included by this assembly is skipped.
+static void include_source(void *context, const char *name, size_t column) {
+	Assembler *A = context;
+	Diagnostics *D = &A->diagnostics;
+	if (A->depth == MAX_INCLUDE_DEPTH) {
+		diag_fail(D, FAILURE_LIMITS, column, ".include nested too deeply (limit is %u)", MAX_INCLUDE_DEPTH);
+	}
+	char *opened;
+	char *path = source_path(A, name, &opened);
+	const char *open = opened ? opened : path;
+	FileId id;
+	if (!file_id(open, &id)) {
+		diag_error(D, FAILURE_IO, column, "could not read file \"%s\"", path);
+		diag_release(D, opened);
+		diag_release(D, path);
+		return;
+	}
+	for (size_t i = 0; i < A->include_count; ++i) {
+		if (A->included[i] && same_file(&A->included[i]->id, &id)) {
+			LOGF_DEBUG("include: %s was already included", path);
+			diag_release(D, opened);
+			diag_release(D, path);
+			return;
+		}
+	}
+	int failure;
+	IncludeEntry *entry = include_acquire(open, &id, &failure);
+	diag_release(D, opened);
+	if (!entry) {
+		if (failure == FAILURE_MEMORY) {
+			diag_release(D, path);
+			diag_fatal(D, FAILURE_MEMORY, "ran out of memory");
+		}
+		diag_error(D, FAILURE_IO, column, "could not read file \"%s\"", path);
+		diag_release(D, path);
+		return;
+	}
+	add_include(A, path, entry);
+
+	LOGF_INFO("include %s", path);
+	size_t line = D->line;
+	const char *source = D->source;
+	const char *include = D->include;
+	jmp_buf *recover = D->recover;
+	A->depth += 1;
+	D->include = path;
+	if (entry->chunk) {
+		encode_lines(A, entry->chunk);
+	}
+	else {
+		LineSource lines = { entry->text, entry->length, 0, NULL, MAX_LINE_CHARS };
+		read_lines(A, &lines);
+	}
+	A->depth -= 1;
+	D->line = line;
+	D->source = source;
+	D->include = include;
+	D->recover = recover;
+}
+
+// == Macros ==
+// The lines between `.macro NAME PARAM...` and `.endm` are lexed and parsed
+// once into the macro's own tokens. Where NAME later stands in place of a
+// statement, each set of arguments seen for the first time gets a copy of
+// those tokens with every parameter replaced by its argument, kept with the
+// macro, and the copied lines are processed in order; the same arguments
+// again reuse the copy. Parameters and arguments are single tokens, with or
+// without commas between them. Errors in an expansion point at the line of
+// the macro they come from.
+
+typedef struct MacroLine {
+	char *text;         // for diagnostics, and what the tokens point into
+	size_t line;
+	size_t first_token;
+	size_t nTokens;
+} MacroLine;
+
+typedef struct Expansion {
+	char *text;         // what the arguments point into
+	Token *tokens;      // the body with the arguments in place; owns nothing
+	struct Expansion *next;
+	Token args[];
+} Expansion;
+
+struct Macro {
+	char *names;        // the name and then the parameters, one after the other
+	StringSlice name;
+	StringSlice params[MAX_MACRO_PARAMS];
+	size_t nParams;
+	bool valid;         // a definition with errors is read to its .endm and dropped
+	const char *file;   // Diagnostics.include where it was defined
+	size_t line;
+	MacroLine *lines;
+	size_t nLines;
+	size_t line_capacity;
+	Token *tokens;      // of every line; may own memory
+	size_t nTokens;
+	size_t token_capacity;
+	Expansion *expansions;
+	Macro *next;
+};
+
+static bool slice_equals(StringSlice a, StringSlice b) {
+	return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
+}
+static bool is_text(const TokenData *data) {
+	return data->dataType == TDT_String || data->dataType == TDT_StringOwned || data->dataType == TDT_StringSlice;
+}
+static bool same_token(Diagnostics *D, Token *a, Token *b) {
+	if (a->type != b->type) {
+		return false;
+	}
+	if (is_text(&a->data) || is_text(&b->data)) {
+		return is_text(&a->data)
+			&& is_text(&b->data)
+			&& slice_equals(tokendata_expect_string(&a->data, D), tokendata_expect_string(&b->data, D));
+	}
+	if (a->data.dataType != b->data.dataType) {
+		return false;
+	}
+	switch (a->data.dataType) {
+		case TDT_Character:
+			return a->data.character == b->data.character;
+		case TDT_Word:
+			return a->data.word == b->data.word;
+		case TDT_Integer:
+			return a->data.integer == b->data.integer;
+		case TDT_Size:
+			return a->data.size == b->data.size;
+		case TDT_InstructionMeta:
+			return a->data.instruction_meta.format == b->data.instruction_meta.format
+				&& a->data.instruction_meta.instruction_mask == b->data.instruction_meta.instruction_mask;
+		case TDT_DirectiveType:
+			return a->data.directive_type == b->data.directive_type;
+		case TDT_Void:
+			return true;
+		default:
+			return a->data.pointer == b->data.pointer;
+	}
+}
+
+static void free_expansions(Diagnostics *D, Macro *macro) {
+	while (macro->expansions) {
+		Expansion *next = macro->expansions->next;
+		diag_release(D, macro->expansions->tokens);
+		diag_release(D, macro->expansions->text);
+		diag_release(D, macro->expansions);
+		macro->expansions = next;
+	}
+}
+static void free_macro(Assembler *A, Macro *macro) {
+	Diagnostics *D = &A->diagnostics;
+	free_expansions(D, macro);
+	for (size_t i = 0; i < macro->nTokens; ++i) {
+		free_tokendata(&macro->tokens[i].data, D);
+	}
+	for (size_t i = 0; i < macro->nLines; ++i) {
+		diag_release(D, macro->lines[i].text);
+	}
+	diag_release(D, macro->tokens);
+	diag_release(D, macro->lines);
+	diag_release(D, macro->names);
+	diag_release(D, macro);
+}
+static void release_macros(Assembler *A) {
+	while (A->macros) {
+		Macro *next = A->macros->next;
+		free_macro(A, A->macros);
+		A->macros = next;
+	}
+	if (A->defining) {
+		free_macro(A, A->defining);
+		A->defining = NULL;
+	}
+}
+static Macro *find_macro(Assembler *A, Token *token) {
+	if (token->type != TT_Identifier) {
+		return NULL;
+	}
+	StringSlice name = tokendata_expect_string(&token->data, &A->diagnostics);
+	for (Macro *macro = A->macros; macro; macro = macro->next) {
+		if (slice_equals(macro->name, name)) {
+			return macro;
+		}
+	}
+	return NULL;
+}
+
+// Starts the definition on a `.macro` line; one with errors still takes the
+// lines up to its .endm.
+static void begin_macro(Assembler *A, Token *tokens, size_t nTokens) {
+	Diagnostics *D = &A->diagnostics;
+	Macro *macro = diag_alloc(D, sizeof(Macro));
+	memset(macro, 0, sizeof(*macro));
+	macro->file = D->include;
+	macro->line = D->line;
+	A->defining = macro;
+	A->defining_depth = A->depth;
+	if (A->expanding > 0) {
+		diag_error(D, FAILURE_SYNTAX, tokens[0].column, ".macro cannot be defined by a macro");
+		return;
+	}
+	if (nTokens < 2 || tokens[1].type != TT_Identifier) {
+		diag_error(D, FAILURE_SYNTAX, tokens[0].column, ".macro expects a name");
+		return;
+	}
+	if (find_macro(A, &tokens[1])) {
+		diag_error(D, FAILURE_SYNTAX, tokens[1].column, "macro already defined");
+		return;
+	}
+	size_t length = 0;
+	for (size_t i = 1; i < nTokens; ++i) {
+		if (tokens[i].type == TT_Comma && i > 1) {
+			continue;
+		}
+		if (tokens[i].type != TT_Identifier) {
+			diag_error(D, FAILURE_SYNTAX, tokens[i].column, ".macro expects parameter names");
+			return;
+		}
+		length += tokendata_expect_string(&tokens[i].data, D).length;
+	}
+	macro->names = diag_alloc(D, length);
+	char *cursor = macro->names;
+	for (size_t i = 1; i < nTokens; ++i) {
+		if (tokens[i].type == TT_Comma) {
+			continue;
+		}
+		StringSlice slice = tokendata_expect_string(&tokens[i].data, D);
+		memcpy(cursor, slice.start, slice.length);
+		slice.start = cursor;
+		cursor += slice.length;
+		if (i == 1) {
+			macro->name = slice;
+			continue;
+		}
+		for (size_t p = 0; p < macro->nParams; ++p) {
+			if (slice_equals(macro->params[p], slice)) {
+				diag_error(D, FAILURE_SYNTAX, tokens[i].column, "duplicate parameter '%.*s'", (int)slice.length, slice.start);
+				return;
+			}
+		}
+		macro->params[macro->nParams++] = slice;
+	}
+	macro->valid = true;
+}
+// Every expansion would define a label again, so a line may only start with
+// a name when that is a parameter, whose argument then names the label, or a
+// macro defined so far.
+static bool macro_line_starts_ok(Assembler *A, Macro *macro, Token *first) {
+	if (first->type != TT_Identifier) {
+		return true;
+	}
+	StringSlice name = tokendata_expect_string(&first->data, &A->diagnostics);
+	for (size_t p = 0; p < macro->nParams; ++p) {
+		if (slice_equals(macro->params[p], name)) {
+			return true;
+		}
+	}
+	if (slice_equals(macro->name, name) || find_macro(A, first)) {
+		return true;
+	}
+	diag_error(
+		&A->diagnostics,
+		FAILURE_SYNTAX,
+		first->column,
+		"macro %.*s cannot define label '%.*s'; pass the label as an argument",
+		(int)macro->name.length,
+		macro->name.start,
+		(int)name.length,
+		name.start);
+	return false;
+}
+// Keeps a line of the definition, lexed and parsed again from a copy of its
+// text so that its tokens outlive the line.
+static void add_macro_line(Assembler *A, Macro *macro) {
+	Diagnostics *D = &A->diagnostics;
+	if (!macro->valid) {
+		return;
+	}
+	if (macro->nLines == macro->line_capacity) {
+		macro->line_capacity = macro->line_capacity ? macro->line_capacity * 2 : 4;
+		macro->lines = diag_realloc(D, macro->lines, macro->line_capacity * sizeof(MacroLine));
+	}
+	if (macro->token_capacity - macro->nTokens < MAX_LINE_TOKENS) {
+		macro->token_capacity = macro->token_capacity ? macro->token_capacity * 2 : MAX_LINE_TOKENS;
+		macro->tokens = diag_realloc(D, macro->tokens, macro->token_capacity * sizeof(Token));
+	}
+	size_t length = strlen(D->source);
+	char *text = diag_alloc(D, length + 1);
+	memcpy(text, D->source, length + 1);
+	MacroLine *line = &macro->lines[macro->nLines++];
+	*line = (MacroLine){ text, D->line, macro->nTokens, 0 };
+	Lexeme lexemes[MAX_LINE_TOKENS];
+	int nLexemes = lex_line(D, text, lexemes);
+	size_t nParsed = 0;
+	bool parsed = nLexemes >= 0 && parse_line(D, text, lexemes, nLexemes, &macro->tokens[macro->nTokens], &nParsed);
+	macro->nTokens += nParsed;
+	if (parsed && nParsed > 0 && macro->tokens[macro->nTokens - 1].type == TT_Comment) {
+		// every expansion would copy it for nothing
+		nParsed -= 1;
+		macro->nTokens -= 1;
+		free_tokendata(&macro->tokens[macro->nTokens].data, D);
+	}
+	line->nTokens = parsed ? nParsed : 0;
+	if (line->nTokens > 0 && !macro_line_starts_ok(A, macro, &macro->tokens[line->first_token])) {
+		line->nTokens = 0;
+	}
+}
+static void end_macro(Assembler *A) {
+	Macro *macro = A->defining;
+	A->defining = NULL;
+	if (!macro->valid) {
+		free_macro(A, macro);
+		return;
+	}
+	LOGF_DEBUG("macro %.*s: %zu lines", (int)macro->name.length, macro->name.start, macro->nLines);
+	// definitions stay for the whole assembly, which may be streaming within a small bound
+	if (macro->nLines > 0 && macro->nTokens > 0) {
+		macro->lines = diag_realloc(&A->diagnostics, macro->lines, macro->nLines * sizeof(MacroLine));
+		macro->tokens = diag_realloc(&A->diagnostics, macro->tokens, macro->nTokens * sizeof(Token));
+		macro->line_capacity = macro->nLines;
+		macro->token_capacity = macro->nTokens;
+	}
+	macro->next = A->macros;
+	A->macros = macro;
+}
+// A definition left open drops out with the source it started in.
+static void macro_source_end(Assembler *A) {
+	if (A->defining && A->defining_depth == A->depth) {
+		diag_error_at(&A->diagnostics, FAILURE_SYNTAX, A->defining->line, 0, ".macro without .endm");
+		free_macro(A, A->defining);
+		A->defining = NULL;
+	}
+}
+
+// Returns the copy of the body for these arguments, making it the first time.
+static Expansion *expansion_for(Assembler *A, Macro *macro, Token **args) {
+	Diagnostics *D = &A->diagnostics;
+	for (Expansion *expansion = macro->expansions; expansion; expansion = expansion->next) {
+		size_t p = 0;
+		while (p < macro->nParams && same_token(D, &expansion->args[p], args[p])) {
+			p += 1;
+		}
+		if (p == macro->nParams) {
+			STATS_COUNT(SC_ExpansionHits, 1);
+			return expansion;
+		}
+	}
+	STATS_COUNT(SC_Expansions, 1);
+	Expansion *expansion = diag_alloc(D, sizeof(Expansion) + macro->nParams * sizeof(Token));
+	memset(expansion, 0, sizeof(*expansion));
+	expansion->next = macro->expansions;
+	macro->expansions = expansion;
+	size_t length = 0;
+	for (size_t p = 0; p < macro->nParams; ++p) {
+		if (is_text(&args[p]->data)) {
+			length += tokendata_expect_string(&args[p]->data, D).length;
+		}
+	}
+	expansion->text = diag_alloc(D, length + 1);
+	char *cursor = expansion->text;
+	for (size_t p = 0; p < macro->nParams; ++p) {
+		Token *arg = &expansion->args[p];
+		*arg = *args[p];
+		if (is_text(&arg->data)) {
+			StringSlice slice = tokendata_expect_string(&arg->data, D);
+			memcpy(cursor, slice.start, slice.length);
+			arg->data.dataType = TDT_StringSlice;
+			arg->data.string_slice = (StringSlice){ cursor, slice.length };
+			cursor += slice.length;
+		}
+	}
+	if (macro->nTokens > 0) {
+		expansion->tokens = diag_alloc(D, macro->nTokens * sizeof(Token));
+		memcpy(expansion->tokens, macro->tokens, macro->nTokens * sizeof(Token));
+	}
+	for (size_t i = 0; i < macro->nTokens; ++i) {
+		Token *token = &expansion->tokens[i];
+		if (token->type != TT_Identifier) {
+			continue;
+		}
+		StringSlice name = tokendata_expect_string(&token->data, D);
+		for (size_t p = 0; p < macro->nParams; ++p) {
+			if (slice_equals(macro->params[p], name)) {
+				token->type = expansion->args[p].type;
+				token->data = expansion->args[p].data;
+				break;
+			}
+		}
+	}
+	return expansion;
+}
+void emit_preamble(CompilationUnit *CU, size_t alignment, Token *label);
+static bool try_register_label(CompilationUnit *CU, Token *label) {
+	jmp_buf recover;
+	if (setjmp(recover)) {
+		CU->diagnostics->recover = NULL;
+		return false;
+	}
+	CU->diagnostics->recover = &recover;
+	emit_preamble(CU, 1, label);
+	CU->diagnostics->recover = NULL;
+	return true;
+}
+// Processes the lines of `macro` for the arguments in `tokens`, after
+// `label` (or NULL) takes the address they start at.
+static void expand_macro(Assembler *A, Macro *macro, Token *label, Token *tokens, size_t nTokens) {
+	Diagnostics *D = &A->diagnostics;
+	// the name of the macro comes right before its arguments
+	Token *name = &tokens[-1];
+	Token *args[MAX_MACRO_PARAMS];
+	size_t nArgs = 0;
+	for (size_t i = 0; i < nTokens; ++i) {
+		if (tokens[i].type != TT_Comma) {
+			if (nArgs < macro->nParams) {
+				args[nArgs] = &tokens[i];
+			}
+			nArgs += 1;
+		}
+	}
+	if (nArgs != macro->nParams) {
+		diag_error(
+			D,
+			FAILURE_SYNTAX,
+			name->column,
+			"macro %.*s takes %zu arguments; got %zu",
+			(int)macro->name.length,
+			macro->name.start,
+			macro->nParams,
+			nArgs);
+		return;
+	}
+	if (A->expanding == MAX_MACRO_DEPTH) {
+		diag_error(D, FAILURE_LIMITS, name->column, "macros nested too deeply (limit is %u)", MAX_MACRO_DEPTH);
+		return;
+	}
+	if (label && !try_register_label(&A->CU, label)) {
+		return;
+	}
+	Expansion *expansion = expansion_for(A, macro, args);
+
+	size_t line = D->line;
+	const char *source = D->source;
+	const char *include = D->include;
+	A->expanding += 1;
+	for (size_t i = 0; i < macro->nLines && !diag_limit_reached(D); ++i) {
+		MacroLine *body = &macro->lines[i];
+		D->line = body->line;
+		D->source = body->text;
+		D->include = macro->file;
+		assemble_line(A, &expansion->tokens[body->first_token], body->nTokens);
+	}
+	A->expanding -= 1;
+	D->line = line;
+	D->source = source;
+	D->include = include;
+	if (D->budget && A->expanding == 0) {
+		// within a memory bound only the definitions are kept
+		for (Macro *defined = A->macros; defined; defined = defined->next) {
+			free_expansions(D, defined);
+		}
+	}
+}
+
+static bool is_directive(const Token *token, DirectiveType type) {
+	return token->type == TT_Directive && token->data.directive_type == type;
+}
+// Runs a line through the unit, unless it is part of a macro definition or
+// calls a macro.
+static void assemble_line(Assembler *A, Token *tokens, size_t nTokens) {
+	Diagnostics *D = &A->diagnostics;
+	size_t count = nTokens;
+	if (count > 0 && tokens[count - 1].type == TT_Comment) {
+		count -= 1;
+	}
+	bool labeled = count > 1 && tokens[0].type == TT_Identifier;
+	Token *statement = labeled ? &tokens[1] : tokens;
+	if (A->defining) {
+		if (count == 0) {
+			return;
+		}
+		if (is_directive(statement, DT_EndMacro)) {
+			if (labeled) {
+				diag_error(D, FAILURE_SYNTAX, tokens[0].column, ".endm cannot have a label");
+			}
+			end_macro(A);
+		}
+		else if (is_directive(statement, DT_Macro)) {
+			diag_error(D, FAILURE_SYNTAX, statement->column, ".macro cannot be nested");
+		}
+		else {
+			add_macro_line(A, A->defining);
+		}
+		return;
+	}
+	if (count > 0 && is_directive(statement, DT_Macro)) {
+		if (labeled) {
+			diag_error(D, FAILURE_SYNTAX, tokens[0].column, ".macro cannot have a label");
+		}
+		begin_macro(A, statement, count - labeled);
+		return;
+	}
+	if (count > 0 && is_directive(statement, DT_EndMacro)) {
+		diag_error(D, FAILURE_SYNTAX, statement->column, ".endm without .macro");
+		return;
+	}
+	if (A->macros && count > 0) {
+		Macro *macro = find_macro(A, &tokens[0]);
+		if (macro) {
+			expand_macro(A, macro, NULL, &tokens[1], count - 1);
+			return;
+		}
+		macro = labeled ? find_macro(A, &tokens[1]) : NULL;
+		if (macro) {
+			expand_macro(A, macro, &tokens[0], &tokens[2], count - 2);
+			return;
+		}
+	}
+	try_process_line(&A->CU, D->line, tokens, nTokens);
+}
+
+void process_instruction(CompilationUnit *CU, Line *line);
+void process_word_literal(CompilationUnit *CU, Line *line);
+void process_directive(CompilationUnit *CU, Line *line);
+void process_line(CompilationUnit *CU, size_t line_number, Token *tokens, size_t nTokens) {
+	LOGF_TRACE("process line %zu (tokens: %p; nTokens: %zu)", line_number, (void*)tokens, nTokens);
+
+	enum {
+		MAX_ARGUMENTS = 5,
+	};
+
+	Line line = {0};
+	Argument args[MAX_ARGUMENTS] = {0};
+
+	// ignore empty lines
+	if (nTokens == 0) {
+		LOGF_TRACE("line empty");
+		return;
+	}
+
+	// handle comment
+	if (tokens[nTokens - 1].type == TT_Comment) {
+		line.comment = &tokens[nTokens - 1];
+		nTokens -= 1;
+	}
+	if (nTokens == 0) {
+		LOGF_TRACE("line empty");
+		return;
+	}
+
+	// handle label
+	if (tokens[0].type == TT_Identifier) {
+		line.label = &tokens[0];
+		tokens += 1;
+		nTokens -= 1;
+		if (nTokens == 0) {
+			diag_fail(CU->diagnostics, FAILURE_SYNTAX, line.label->column, "dangling label");
+		}
+	}
+
+	// handle statement
+	line.statement = &tokens[0];
+	tokens += 1;
+	nTokens -= 1;
+
+	// handle arguments
+	LOGF_TRACE("arguments");
+	if (nTokens > 0) {
+		if (tokens[nTokens - 1].type == TT_Comma) {
+			diag_fail(CU->diagnostics, FAILURE_SYNTAX, tokens[nTokens - 1].column, "dangling comma");
+		}
+		line.args = args;
+		size_t nArgs = 0;
+		Token *last = tokens;
+		for (size_t i = 0; i < nTokens; ++i) {
+			if (tokens[i].type == TT_Comma) {
+				if (nArgs + 1 >= MAX_ARGUMENTS) {
+					diag_fail(
+						CU->diagnostics,
+						FAILURE_LIMITS,
+						tokens[i].column,
+						"too many arguments on one line (limit is %u)",
+						MAX_ARGUMENTS);
+				}
+				line.args[nArgs++] = (Argument){ last, &tokens[i] - last };
+				last = &tokens[i + 1];
+			}
+		}
+		line.args[nArgs++] = (Argument){ last, &tokens[nTokens] - last };
+		line.nArgs = nArgs;
+	}
+	else {
+		line.args = NULL;
+		line.nArgs = 0;
+	}
+
+	// process line
+	switch (line.statement->type) {
+		case TT_Instruction:
+			process_instruction(CU, &line);
+			break;
+		case TT_WordLiteral:
+			process_word_literal(CU, &line);
+			break;
+		case TT_Directive:
+			process_directive(CU, &line);
+			break;
+		default:
+			diag_fail(CU->diagnostics, FAILURE_SYNTAX, line.statement->column, "expecting instruction or directive");
+	}
+}
+static void expect_n_args(CompilationUnit *CU, Line *line, size_t expected);
+static int expect_reg(CompilationUnit *CU, Argument *arg, const char *name);
+static long expect_off(CompilationUnit *CU, Argument *arg, size_t bits, const char *name);
+static int try_reg(CompilationUnit *CU, Argument *arg);
+static int try_imm(CompilationUnit *CU, Argument *arg, size_t bits, bool errorOnTooLarge);
+static bool validate_imm(long number, size_t nBits);
+static size_t arg_column(Argument *arg);
+void emit_preamble(CompilationUnit *CU, size_t alignment, Token *label);
+void process_instruction(CompilationUnit *CU, Line *line) {
+	LOGF_TRACE("instruction");
+	Token *instruction = line->statement;
+	Argument *args = line->args;
+	if (instruction->data.dataType != TDT_InstructionMeta) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "expecting instruction; got (%u)", instruction->data.dataType);
+	}
+	InstructionMeta *meta = &instruction->data.instruction_meta;
+	uint16_t word = meta->instruction_mask;
+	emit_preamble(CU, 1, line->label);
+	switch (meta->format) {
+		case IF_Arithmetic: {
+			expect_n_args(CU, line, 3);
+			int dest = expect_reg(CU, &args[0], "first");
+			int lhs = expect_reg(CU, &args[1], "second");
+			int rhs = try_reg(CU, &args[2]);
+			if (rhs < 0) {
+				rhs = try_imm(CU, &args[2], 5, true);
+				if (rhs < 0) {
+					diag_fail(
+						CU->diagnostics,
+						FAILURE_SYNTAX,
+						arg_column(&args[2]),
+						"expecting register or immediate as third argument; found (%u)",
+						args[2].count == 1 ? args[2].tokens[0].type : (TokenType)0);
+				}
+				rhs |= 0x20;
+			}
+			word |= dest << 9;
+			word |= lhs << 6;
+			word |= rhs;
+			break;
+		}
+		case IF_DestOffset: {
+			expect_n_args(CU, line, 2);
+			int dest = expect_reg(CU, &args[0], "first");
+			long offset = expect_off(CU, &args[1], 9, "second");
+			word |= dest << 9;
+			word |= offset;
+			break;
+		}
+		case IF_Offset9: {
+			expect_n_args(CU, line, 1);
+			long offset = expect_off(CU, &args[0], 9, "first");
+			word |= offset;
+			break;
+		}
+		case IF_BaseR: {
+			expect_n_args(CU, line, 1);
+			int dest = expect_reg(CU, &args[0], "first");
+			word |= dest << 6;
+			break;
+		}
+		default:
+			diag_fail(
+				CU->diagnostics,
+				FAILURE_NOTIMPLEMENTED,
+				instruction->column,
+				"instruction format (%u) not implemented",
+				meta->format);
+	}
+	cu_emit_word(CU, word);
+	cu_mark(CU, WK_Code);
+}
+static size_t arg_column(Argument *arg) {
+	return arg->count > 0 ? arg->tokens[0].column : 0;
+}
+static void expect_n_args(CompilationUnit *CU, Line *line, size_t expected) {
+	if (line->nArgs != expected) {
+		diag_fail(
+			CU->diagnostics,
+			FAILURE_SYNTAX,
+			line->statement->column,
+			"expecting %zu arguments; found %zu",
+			expected,
+			line->nArgs);
+	}
+}
+static int expect_reg(CompilationUnit *CU, Argument* arg, const char *name) {
+	int index = try_reg(CU, arg);
+	if (index < 0) {
+		diag_fail(CU->diagnostics, FAILURE_SYNTAX, arg_column(arg), "expecting register as %s argument", name);
+	}
+	return index;
+}
+static long expect_off(CompilationUnit *CU, Argument *arg, size_t nBits, const char *name) {
+	long offset = try_imm(CU, arg, nBits, true);
+	if (offset < 0) {
+		if (arg->count == 1 && arg->tokens[0].type == TT_Identifier) {
+			StringSlice slice = tokendata_expect_string(&arg->tokens[0].data, CU->diagnostics);
+			uint16_t target;
+			if (cu_label_get_target(CU, slice.start, slice.length, &target)) {
+				offset = -1L - cu_cursor_get(CU) + target;
+				if (!validate_imm(offset, nBits)) {
+					diag_fail(
+						CU->diagnostics,
+						FAILURE_SYNTAX,
+						arg_column(arg),
+						"offset for label %.*s (%li) does not fit in %zu bits",
+						(int)slice.length,
+						slice.start,
+						offset,
+						nBits);
+				}
+			}
+			else {
+				cu_late_link(CU, cu_cursor_get(CU), LLT_OffsetPlusOneImm9, slice.start, slice.length, arg_column(arg));
+				offset = 0;
+			}
+		}
+		else {
+			diag_fail(
+				CU->diagnostics,
+				FAILURE_SYNTAX,
+				arg_column(arg),
+				"expecting symbol or number as %s argument; found (%u)",
+				name,
+				arg->count == 1 ? arg->tokens[0].type : (TokenType)0);
+		}
+	}
+	return offset & ~(~0ul << nBits);
+}
+static void expect_single_token(CompilationUnit *CU, Argument *arg) {
+	if (arg->count > 1) {
+		diag_fail(CU->diagnostics, FAILURE_NOTIMPLEMENTED, arg->tokens[1].column, "multiple token arg");
+	}
+}
+static int try_reg(CompilationUnit *CU, Argument *arg) {
+	if (arg->count == 0) {
+		return -1;
+	}
+	expect_single_token(CU, arg);
+	Token *token = &arg->tokens[0];
+	if (token->type != TT_Register) {
+		return -1;
+	}
+	if (token->data.dataType != TDT_Integer) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "unexpected register data type (%u)", token->data.dataType);
+	}
+	int index = token->data.integer;
+	if (index < 0 || index > 7) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "register value out of range (%i)", index);
+	}
+	return index;
+}
+static int try_imm(CompilationUnit *CU, Argument *arg, size_t nBits, bool errorOnTooLarge) {
+	if (arg->count == 0) {
+		return -1;
+	}
+	expect_single_token(CU, arg);
+	Token *token = &arg->tokens[0];
+	if (nBits <= 1 || nBits > 12) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "nBits out of range (%zu)", nBits);
+	}
+	if (token->type != TT_Number) {
+		return -1;
+	}
+	if (token->data.dataType != TDT_Integer) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "unexpected number data type (%u)", token->data.dataType);
+	}
+	int number = token->data.integer;
+	if (!validate_imm(number, nBits)) {
+		if (errorOnTooLarge) {
+			diag_fail(
+				CU->diagnostics,
+				FAILURE_SYNTAX,
+				token->column,
+				"number (%i) does not fit in %zu bits",
+				number,
+				nBits);
+		}
+		else {
+			return -1;
+		}
+	}
+	return number & ~(~0ul << nBits);
+}
+static bool try_int(CompilationUnit *CU, Argument *arg, long *result) {
+	if (arg->count == 0) {
+		return false;
+	}
+	expect_single_token(CU, arg);
+	Token *token = &arg->tokens[0];
+	switch (token->type) {
+		case TT_Number:
+			if (token->data.dataType != TDT_Integer) {
+				diag_fatal(
+					CU->diagnostics,
+					FAILURE_INTERNAL,
+					"unexpected number data type (%u)",
+					token->data.dataType);
+			}
+			*result = token->data.integer;
+			return true;
+		case TT_HexIdentifier: {
+			StringSlice string = tokendata_expect_string(&token->data, CU->diagnostics);
+			char *end;
+			unsigned long value = strtoul(string.start, &end, 16);
+			if (end != string.start + string.length || value >= 0x7FFFFFFF) {
+				diag_fail(CU->diagnostics, FAILURE_SYNTAX, token->column, "bad hex integer");
+			}
+			*result = (long)value;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+static bool validate_imm(long number, size_t nBits) {
+	// signed range: every bit from the sign bit up must match
+	unsigned long mask = ~0ul << (nBits - 1);
+	return !(number & mask && ~number & mask);
+}
+void process_word_literal(CompilationUnit *CU, Line *line) {
+	LOGF_TRACE("word literal");
+	if (line->nArgs > 0) {
+		diag_fail(CU->diagnostics, FAILURE_SYNTAX, arg_column(&line->args[0]), "expecting no arguments");
+	}
+	emit_preamble(CU, 1, line->label);
+	cu_emit_word(CU, line->statement->data.word);
+	cu_mark(CU, WK_Code);
+}
+// A number in [-0x8000 .. 0xFFFF], a character or a label's address.
+static uint16_t expect_word(CompilationUnit *CU, Argument *arg, const char *name) {
+	long number;
+	if (arg->count == 0) {
+		diag_fail(CU->diagnostics, FAILURE_SYNTAX, 0, "empty argument");
+	}
+	if (try_int(CU, arg, &number)) {
+		if (number < -0x8000 || number > 0xFFFF) {
+			diag_fail(
+				CU->diagnostics,
+				FAILURE_SYNTAX,
+				arg_column(arg),
+				"%s expects a word between [-0x8000 .. 0xFFFF]; got %li",
+				name,
+				number);
+		}
+		return (uint16_t)number;
+	}
+	Token *token = &arg->tokens[0];
+	switch (token->type) {
+		case TT_Character:
+			return (uint8_t)token->data.character;
+		case TT_Identifier: {
+			StringSlice slice = tokendata_expect_string(&token->data, CU->diagnostics);
+			uint16_t target;
+			if (cu_label_get_target(CU, slice.start, slice.length, &target)) {
+				return target;
+			}
+			cu_late_link(CU, cu_cursor_get(CU), LLT_AbsoluteWord, slice.start, slice.length, token->column);
+			return 0;
+		}
+		default:
+			diag_fail(
+				CU->diagnostics,
+				FAILURE_SYNTAX,
+				token->column,
+				"%s expects a number, character or label",
+				name);
+	}
+}
+// Copies the mapped file into the object, releasing the mapping before any
+// error is passed on.
+static void emit_mapped(CompilationUnit *CU, MappedFile *file, size_t column) {
+	Diagnostics *D = CU->diagnostics;
+	jmp_buf *recover = D->recover;
+	jmp_buf *abandon = D->abort;
+	jmp_buf release;
+	if (setjmp(release)) {
+		D->recover = recover;
+		D->abort = abandon;
+		unmap_file(file);
+		longjmp(D->fatal || !recover ? *abandon : *recover, 1);
+	}
+	D->recover = &release;
+	D->abort = &release;
+	if (file->size / 2 > 0xFFFF) {
+		diag_fail(D, FAILURE_LIMITS, column, ".incbin file too large (%zu bytes)", file->size);
+	}
+	if (file->size >= 2) {
+		cu_emit_image(CU, file->data, file->size / 2);
+	}
+	if (file->size % 2) {
+		// an odd last byte goes into the high half of a word
+		cu_emit_word(CU, (uint16_t)(file->data[file->size - 1] << 8));
+	}
+	D->recover = recover;
+	D->abort = abandon;
+	unmap_file(file);
+}
+void process_directive(CompilationUnit *CU, Line *line) {
+	LOGF_TRACE("directive");
+
+	Token *directive = line->statement;
+	Argument *args = line->args;
+	size_t nArgs = line->nArgs;
+	Token *label = line->label;
+	Diagnostics *D = CU->diagnostics;
+	if (directive->data.dataType != TDT_DirectiveType) {
+		diag_fatal(CU->diagnostics, FAILURE_INTERNAL, "expecting directive; got (%u)", directive->data.dataType);
+	}
+	switch (directive->data.directive_type) {
+		case DT_Origin: {
+			LOGF_TRACE(".origin");
+			if (label) {
+				diag_fail(D, FAILURE_SYNTAX, label->column, ".origin cannot have a label");
+			}
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".origin expects exactly one argument");
+			}
+			Argument *arg = args;
+			long number;
+			if (!try_int(CU, arg, &number)) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(arg), ".origin expects a number between [0 .. 0xFFFF]");
+			}
+			if (number < 0 || number > 0xFFFF) {
+				diag_fail(
+					D,
+					FAILURE_SYNTAX,
+					arg_column(arg),
+					".origin expects a number between between [0 .. 0xFFFF]; got %li",
+					number);
+			}
+			uint16_t origin = (uint16_t)number;
+			if (!cu_origin_set(CU, origin)) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".origin was already set");
+			}
+			break;
+		}
+		case DT_StringZ: {
+			LOGF_TRACE(".stringz");
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".stringz expects exactly one argument");
+			}
+			Argument *arg = args;
+			if (arg->count == 0) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, "empty argument");
+			}
+			expect_single_token(CU, arg);
+			if (arg->tokens[0].type != TT_String) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(arg), ".stringz expects a string literal");
+			}
+			StringSlice slice = tokendata_expect_string(&args->tokens[0].data, CU->diagnostics);
+			emit_preamble(CU, 1, line->label);
+			if (slice.length > 0) {
+				cu_emit_bytes(CU, (uint8_t*)slice.start, slice.length);
+			}
+			cu_emit_word(CU, 0);
+			break;
+		}
+		case DT_StringP: {
+			LOGF_TRACE(".stringp");
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".stringp expects exactly one argument");
+			}
+			Argument *arg = args;
+			if (arg->count == 0) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, "empty argument");
+			}
+			expect_single_token(CU, arg);
+			if (arg->tokens[0].type != TT_String) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(arg), ".stringp expects a string literal");
+			}
+			StringSlice slice = tokendata_expect_string(&args->tokens[0].data, CU->diagnostics);
+			emit_preamble(CU, 1, line->label);
+			if (slice.length > 0) {
+				cu_emit_packed(CU, (uint8_t*)slice.start, slice.length);
+			}
+			// PUTSP stops at a word of 0, even after an odd last character
+			cu_emit_word(CU, 0);
+			break;
+		}
+		case DT_Fill: {
+			LOGF_TRACE(".fill");
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".fill expects exactly one argument");
+			}
+			emit_preamble(CU, 1, line->label);
+			cu_emit_word(CU, expect_word(CU, args, ".fill"));
+			if (args->count == 1 && args->tokens[0].type == TT_Identifier) {
+				cu_mark(CU, WK_Address);
+			}
+			break;
+		}
+		case DT_Blkw: {
+			LOGF_TRACE(".blkw");
+			if (nArgs < 1 || nArgs > 2) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".blkw expects a count and an optional fill word");
+			}
+			long count;
+			if (!try_int(CU, args, &count) || count < 1 || count > 0xFFFF) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(args), ".blkw expects a count between [1 .. 0xFFFF]");
+			}
+			uint16_t word = 0;
+			if (nArgs == 2) {
+				long fill;
+				if (!try_int(CU, &args[1], &fill) || fill < -0x8000 || fill > 0xFFFF) {
+					diag_fail(D, FAILURE_SYNTAX, arg_column(&args[1]), ".blkw expects a fill number between [-0x8000 .. 0xFFFF]");
+				}
+				word = (uint16_t)fill;
+			}
+			emit_preamble(CU, 1, line->label);
+			cu_emit_padding(CU, word, (size_t)count);
+			break;
+		}
+		case DT_Incbin: {
+			LOGF_TRACE(".incbin");
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".incbin expects exactly one argument");
+			}
+			Argument *arg = args;
+			if (arg->count == 0) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, "empty argument");
+			}
+			expect_single_token(CU, arg);
+			if (arg->tokens[0].type != TT_String) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(arg), ".incbin expects a file name string");
+			}
+			StringSlice slice = tokendata_expect_string(&arg->tokens[0].data, D);
+			char path[MAX_LINE_CHARS + 1];
+			memcpy(path, slice.start, slice.length);
+			path[slice.length] = 0;
+			MappedFile file;
+			if (CU->incbin) {
+				if (!CU->incbin(CU->include_context, path, arg_column(arg), &file)) {
+					break;
+				}
+			}
+			else if (!map_file(path, &file)) {
+				diag_fail(D, FAILURE_IO, arg_column(arg), "could not read file \"%s\"", path);
+			}
+			emit_preamble(CU, 1, line->label);
+			emit_mapped(CU, &file, arg_column(arg));
+			break;
+		}
+		case DT_Include: {
+			LOGF_TRACE(".include");
+			if (label) {
+				diag_fail(D, FAILURE_SYNTAX, label->column, ".include cannot have a label");
+			}
+			if (nArgs != 1) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, ".include expects exactly one argument");
+			}
+			Argument *arg = args;
+			if (arg->count == 0) {
+				diag_fail(D, FAILURE_SYNTAX, directive->column, "empty argument");
+			}
+			expect_single_token(CU, arg);
+			if (arg->tokens[0].type != TT_String) {
+				diag_fail(D, FAILURE_SYNTAX, arg_column(arg), ".include expects a file name string");
+			}
+			if (!CU->include) {
+				diag_fail(D, FAILURE_NOTIMPLEMENTED, directive->column, ".include is not available when streaming");
+			}
+			StringSlice slice = tokendata_expect_string(&arg->tokens[0].data, D);
+			char path[MAX_LINE_CHARS + 1];
+			memcpy(path, slice.start, slice.length);
+			path[slice.length] = 0;
+			CU->include(CU->include_context, path, arg_column(arg));
+			break;
+		}
+		default:
+			diag_fatal(
+				CU->diagnostics,
+				FAILURE_INTERNAL,
+				"unrecognized directive type (%u)",
+				directive->data.directive_type);
+	}
+}
+void emit_preamble(CompilationUnit *CU, size_t alignment, Token *label) {
+	cu_align_to(CU, alignment);
+	if (label) {
+		StringSlice slice = tokendata_expect_string(&label->data, CU->diagnostics);
+		cu_register_label(CU, slice.start, slice.length, cu_cursor_get(CU));
+	}
+}
+
@@ -0,0 +1,94 @@
+#ifndef __LIBLC3ASM_H__
+#define __LIBLC3ASM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// In-process assembler interface. A call keeps all of its state on the stack
+// and in its result, takes memory only from the given allocator and reports
+// every error as a diagnostic instead of ending the process, so independent
+// calls may run concurrently on different threads. The one exception is the
+// files named by `.include`: they are mapped and tokenized once per process
+// and kept, with malloc(), for every later call that includes them unchanged.
+
+// Memory interface; release() is never called with NULL. A NULL allocator
+// selects malloc/realloc/free.
+typedef struct Lc3Allocator {
+	void *(*allocate)(void *context, size_t size);
+	void *(*reallocate)(void *context, void *pointer, size_t size);
+	void (*release)(void *context, void *pointer);
+	void *context;
+} Lc3Allocator;
+
+typedef struct Lc3Diagnostic {
+	int code;       // lc3asm exit code for the error category (3 limits .. 8 linking)
+	size_t line;    // 1-based; 0 when not tied to a line
+	size_t column;  // 1-based; 0 when unknown
+	char *message;
+	char *source;   // copy of the offending line for the caret display, or NULL
+	char *file;     // the included file the line belongs to, or NULL for the source itself
+} Lc3Diagnostic;
+
+typedef struct Lc3AsmOptions {
+	const char *name;               // source name used when printing diagnostics
+	size_t error_limit;             // stop after this many errors; 0 is unlimited
+	const Lc3Allocator *allocator;  // NULL for malloc/realloc/free; must be thread-safe with threads
+	size_t threads;                 // > 1 splits large sources across this many threads
+	bool optimize;                  // run the peephole optimizer (see lc3opt.h); not when streaming
+	FILE *analysis;                 // write the JSON code report (see analysis.txt) here; not when streaming
+	const char *path;               // where the source was read from, when `name` does not lead there from this
+	                                // process's directory (a server); .include paths are then taken from it
+} Lc3AsmOptions;
+
+typedef struct Lc3AsmResult {
+	int status;                 // 0, or the code of the first (or fatal) error
+	uint8_t *object;            // LC3OBJ image (see object.txt); NULL unless status is 0
+	size_t object_size;
+	Lc3Diagnostic *diagnostics;
+	size_t diagnostic_count;
+	bool limit_reached;         // assembly stopped at options.error_limit
+	size_t peak_memory;         // most working memory in use at once; lc3asm_assemble_stream() only
+	size_t words_saved;         // words the optimizer removed
+	char **includes;            // paths of the files included, in the order they were first met
+	size_t include_count;
+	const char *name;
+	Lc3Allocator allocator;     // releases everything above
+} Lc3AsmResult;
+
+// Assembles `length` bytes of `source`; returns result->status. The result
+// must be released with lc3asm_result_free() whatever the status.
+int lc3asm_assemble(const char *source, size_t length, const Lc3AsmOptions *options, Lc3AsmResult *result);
+void lc3asm_result_free(Lc3AsmResult *result);
+
+// Streaming assembly for machines with little memory: reads `input` a line at
+// a time and writes the LC3OBJ image to `output` as it is produced, patching
+// forward references in place, so `output` must be seekable. Working memory
+// (all but the diagnostics) stays within `memory_limit` bytes, 0 for no
+// limit, or the assembly stops with a limits error. Labels get a fixed table
+// of one entry per LC3ASM_STREAM_BYTES_PER_LABEL bytes of it. The image is not
+// in the result, and `output` holds an incomplete one when the status is not 0.
+enum {
+	LC3ASM_STREAM_BYTES_PER_LABEL = 128,
+};
+int lc3asm_assemble_stream(FILE *input, FILE *output, size_t memory_limit, const Lc3AsmOptions *options, Lc3AsmResult *result);
+
+// Staged interface for pipelines: lc3asm_parse() lexes and parses, and
+// lc3asm_encode() finishes the assembly exactly as lc3asm_assemble() would,
+// releasing `parsed`. The two may run on different threads; `source` and
+// the options must stay valid until lc3asm_encode() returns.
+// lc3asm_parse() returns NULL only when it cannot allocate its handle.
+typedef struct Lc3AsmParsed Lc3AsmParsed;
+Lc3AsmParsed *lc3asm_parse(const char *source, size_t length, const Lc3AsmOptions *options);
+int lc3asm_encode(Lc3AsmParsed *parsed, Lc3AsmResult *result);
+
+// Prints diagnostics as "name:line:column: error: message" with a caret line.
+void lc3asm_print_diagnostics(const Lc3AsmResult *result, FILE *output);
+
+// Prints a make rule saying that `target` depends on `source` and on every
+// file it included, followed by an empty rule for each included file so that
+// make does not stop when one of them is deleted.
+void lc3asm_print_dependencies(const Lc3AsmResult *result, const char *target, const char *source, FILE *output);
+
+#endif//__LIBLC3ASM_H__
@@ -0,0 +1,37 @@
+# .incbin finds its file as .include does, from the directory of the file
+# naming it, and -MD lists it with the included files.
+mkdir sub
+printf 'AB' >sub/a.bin
+printf 'CD' >sub/c.bin
+printf '.org x3000\nla .INCBIN "a.bin"\n.include "i.asm"\n' >sub/m.asm
+printf '.incbin "c.bin"\n.incbin "a.bin"\n' >sub/i.asm
+cat >expected.d <<'END'
+sub/m.obj: sub/m.asm \
+  sub/a.bin \
+  sub/i.asm \
+  sub/c.bin
+
+sub/a.bin:
+
+sub/i.asm:
+
+sub/c.bin:
+END
+
+"$LC3ASM" -MD sub/m.asm >sub/m.obj
+cmp expected.d sub/m.d
+test "$(od -An -tx1 -j32 -N6 sub/m.obj | tr -d ' \n')" = 414243444142
+(cd sub && "$LC3ASM" m.asm) | cmp - sub/m.obj
+
+# the server opens them from the client's directory
+rm sub/m.d
+(cd / && exec "$LC3ASM" --server="$OLDPWD/s.sock") &
+server=$!
+trap 'kill $server' EXIT
+while [ ! -S s.sock ]; do sleep 0.1; done
+"$LC3ASMC" --socket=s.sock -MD sub/m.asm | cmp - sub/m.obj
+cmp expected.d sub/m.d
+
+printf '.org x3000\n.incbin "missing.bin"\n' >sub/e.asm
+if "$LC3ASM" sub/e.asm 2>e.err; then exit 1; fi
+grep -q 'could not read file "sub/missing.bin"' e.err
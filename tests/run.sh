@@ -0,0 +1,18 @@
+#!/bin/sh
+# Runs each tests/*.t with sh -e in a scratch directory, with OUT naming the
+# directory given (default out) and LC3ASM and LC3ASMC the tools built there.
+out=$(cd "${1:-out}" && pwd)
+tests=$(cd "$(dirname "$0")" && pwd)
+failed=0
+for t in "$tests"/*.t; do
+	dir=$(mktemp -d)
+	if (cd "$dir" && OUT="$out" LC3ASM="$out/lc3asm" LC3ASMC="$out/lc3asmc" sh -e "$t") >"$dir.log" 2>&1; then
+		echo "pass $(basename "$t")"
+	else
+		echo "FAIL $(basename "$t")"
+		cat "$dir.log"
+		failed=1
+	fi
+	rm -rf "$dir" "$dir.log"
+done
+exit $failed
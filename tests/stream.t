@@ -0,0 +1,24 @@
+# --stream writes the same object as assembling in memory, with forward
+# references to many labels patched as each label comes.
+{
+	echo '.org x3000'
+	i=0
+	while [ $i -lt 100 ]; do
+		echo ".fill l$i"
+		echo "BRz l$i"
+		i=$((i + 1))
+	done
+	echo '.fill missing'
+	i=0
+	while [ $i -lt 100 ]; do
+		echo "l$i ADD R0, R0, #0"
+		echo ".fill l$i"
+		i=$((i + 1))
+	done
+	echo 'BR missing'
+} >m.asm
+"$LC3ASM" m.asm >memory.obj
+"$LC3ASM" --stream=1000000 m.asm >stream.obj
+cmp memory.obj stream.obj
+
+if "$LC3ASM" --stream m.asm >small.obj 2>small.err; then exit 1; else test $? = 3; fi
@@ -0,0 +1,61 @@
+#include "lc3asm.h"
+
+// Directive names: each full name in any case, and nothing shorter, longer
+// or misspelled.
+static const struct {
+	const char *lexeme;
+	DirectiveType type;     // DT_Invalid where it must not be a directive
+} Cases[] = {
+	{ ".org", DT_Origin },
+	{ ".ORIG", DT_Invalid },
+	{ ".fill", DT_Fill },
+	{ ".FiLl", DT_Fill },
+	{ ".blkw", DT_Blkw },
+	{ ".stringz", DT_StringZ },
+	{ ".STRINGZ", DT_StringZ },
+	{ ".stringp", DT_StringP },
+	{ ".string", DT_Invalid },
+	{ ".STRING", DT_Invalid },
+	{ ".str", DT_Invalid },
+	{ ".s", DT_Invalid },
+	{ ".stringzz", DT_Invalid },
+	{ ".incbin", DT_Incbin },
+	{ ".INCBIN", DT_Incbin },
+	{ ".include", DT_Include },
+	{ ".in", DT_Invalid },
+	{ ".IN", DT_Invalid },
+	{ ".inc", DT_Invalid },
+	{ ".i", DT_Invalid },
+	{ ".includes", DT_Invalid },
+	{ ".incbim", DT_Invalid },
+	{ ".macro", DT_Macro },
+	{ ".MACRO", DT_Macro },
+	{ ".m", DT_Invalid },
+	{ ".mac", DT_Invalid },
+	{ ".endm", DT_EndMacro },
+	{ ".e", DT_Invalid },
+	{ ".end", DT_Invalid },
+	{ ".endmacro", DT_Invalid },
+	{ ".", DT_Invalid },
+};
+
+int main(void) {
+	Diagnostics D;
+	diag_init(&D, "tok", 0, NULL);
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(Cases) / sizeof(Cases[0]); ++i) {
+		const char *lexeme = Cases[i].lexeme;
+		TokenData data;
+		TokenType type = parse(lexeme, strlen(lexeme), &data, &D);
+		DirectiveType directive = type == TT_Directive ? data.directive_type : DT_Invalid;
+		if (directive != Cases[i].type) {
+			fprintf(stderr, "%s: directive %d, expected %d\n", lexeme, directive, Cases[i].type);
+			failed = 1;
+		}
+		else if (type != TT_Directive && type != TT_Invalid) {
+			fprintf(stderr, "%s: token type %d\n", lexeme, type);
+			failed = 1;
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,20 @@
+# Directives are matched by their whole names, in any case.
+"$OUT/toktest"
+
+printf '.org x3000\nla .STRING "ab"\n.In "x.asm"\n.M m\n.e\n.stringz "ok"\n' >m.asm
+if "$LC3ASM" m.asm >m.obj 2>m.err; then exit 1; fi
+cat >expected.err <<'END'
+m.asm:2:4: error: unrecognized directive '.STRING'
+la .STRING "ab"
+   ^
+m.asm:3:1: error: unrecognized directive '.In'
+.In "x.asm"
+^
+m.asm:4:1: error: unrecognized directive '.M'
+.M m
+^
+m.asm:5:1: error: unrecognized directive '.e'
+.e
+^
+END
+diff expected.err m.err